@@ -1,6 +1,7 @@
 // broker_pubsub_quic_like.c
 // Broker UDP con encabezado "tipo QUIC", XOR básico, suscripciones y retransmisión (NACK/ACK)
 
+#define _GNU_SOURCE   // recvmmsg / sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +13,10 @@
 #include <errno.h>
 #include <time.h>
 #include <fcntl.h>
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>   // XOR de a 16/32 bytes
+#endif
 
 #define BUFFER_SIZE 1500
 #define PORT 5928
@@ -19,11 +24,35 @@
 
 #define MAX_CLIENTS 256
 #define MAX_STREAMS 512
+#define CLIENT_TAB (MAX_CLIENTS * 2)  // buckets de la tabla hash de clientes (potencia de 2)
+#define STREAM_TAB (MAX_STREAMS * 2)  // buckets de la tabla hash de streams (potencia de 2)
+#define CLIENT_MAX_SUBS 8             // suscripciones por cliente
 #define MAX_PAYLOAD (BUFFER_SIZE - 64)
-#define RECV_TIMEOUT_SEC 1
 #define BROKER_KEY 173        // Clave XOR compartida (1..255)
-#define HISTORY_DEPTH 512     // Cuántos mensajes por stream guardamos para retransmisión
+#define HISTORY_DEPTH 4096    // Cuántos mensajes por stream guardamos para retransmisión (--history=N)
+#define HISTORY_BYTES (1024 * 1024) // Tope de bytes de payload guardados por stream (--history-bytes=N)
+#define HIST_INIT_COUNT 16    // Tamaño inicial del historial; crece x2 hasta los topes
+#define HIST_INIT_BYTES 4096
+#define COMPACT_SPAN 8        // Con --compact el historial puede abarcar hasta 8 * --history seq
+#define KEY_MAX 64            // La clave de un mensaje (hasta el primer ':') entra en tantos bytes
 #define KEEPALIVE_CLIENT_S 60 // Si no vemos a un cliente en tanto tiempo, lo purgamos
+#define PING_IDLE_S 20        // A un suscriptor callado por tanto tiempo se le manda PING
+#define ACK_MAX_RANGES 8      // Rangos SACK que se aceptan por ACK
+#define INITIAL_RTT_MS 100    // RTT supuesto hasta tener la primera muestra
+#define MAX_ACK_DELAY_MS 25   // Margen para el retraso del ACK en el suscriptor
+#define PTO_BURST 4           // Mensajes sin confirmar que se reenvían por PTO
+#define PTO_MAX_BACKOFF 6     // El PTO se duplica hasta 2^6 veces sin respuesta
+#define PTO_PERSISTENT 3      // PTO seguidos = congestión persistente: ventana al mínimo
+#define CC_MSS BUFFER_SIZE    // Unidad de la ventana: un datagrama lleno
+#define CWND_INIT (10 * CC_MSS)    // Ventana de congestión inicial (bytes en vuelo)
+#define CWND_MIN (2 * CC_MSS)
+#define CWND_MAX (4096 * CC_MSS)
+#define SUB_WINDOW 512        // Control de flujo: seq sin confirmar por suscripción (= REORDER_WINDOW del suscriptor)
+#define PACING_GAIN 1.25      // Se reparte la ventana en el RTT con este margen
+#define PACING_BURST 10       // Datagramas llenos que pueden salir juntos sin esperar al pacer
+#define RX_BATCH 64           // Datagramas por recvmmsg()
+#define TX_BATCH 1024         // Envíos acumulados antes de un sendmmsg()
+#define TX_POOL  256          // Paquetes distintos armados por tanda (cada uno puede ir a muchos destinos)
 
 // ====== Protocolo ======
 #define PROTO_VERSION 1
@@ -37,10 +66,24 @@ typedef enum {
     PKT_ACK = 5,
     PKT_NACK = 6,
     PKT_PING = 7,
-    PKT_PONG = 8
+    PKT_PONG = 8,
+    PKT_FRAMES = 9     // payload: varios frames (DATA/ACK/NACK/...) seguidos
 } pkt_type_t;
 
 #define F_END_STREAM 0x01
+// Fragmento de un mensaje más grande que MAX_PAYLOAD (lo arma el publicador y lo rearma
+// el suscriptor). Para el broker es un mensaje más: tiene su seq, se confirma, se guarda
+// y se reenvía solo, así que una pérdida cuesta un fragmento y no el mensaje entero.
+#define F_FRAG 0x02
+// Valor retenido: el broker guarda el último mensaje con esta marca (vacío = borrarlo) y se
+// lo manda a cada suscriptor nuevo que empiece después de él, justo detrás del SUB_OK.
+#define F_RETAIN 0x04
+// Mensaje con clave: la clave es el principio del payload hasta el primer ':' inclusive
+// ("score:", "minute:"). Con --compact el historial guarda sólo el último de cada clave.
+#define F_KEYED 0x08
+// Sólo del broker al suscriptor: las seq desde la que dice el payload (8 bytes) hasta la del
+// encabezado se compactaron y no van a llegar. Se confirma y se reenvía como cualquier DATA.
+#define F_GAP 0x10
 
 #pragma pack(push, 1)
 typedef struct {
@@ -53,8 +96,26 @@ typedef struct {
     uint64_t seq;
     uint32_t length;
 } quic_like_header_t;
+
+// Frame dentro de un PKT_FRAMES: los mismos campos que el encabezado, más cortos. Van
+// cifrados junto con su payload como parte del payload del paquete.
+typedef struct {
+    uint8_t  type;
+    uint8_t  flags;
+    uint16_t length;
+    uint32_t stream_id;
+    uint64_t seq;
+} quic_like_frame_t;
 #pragma pack(pop)
 
+#define FRAMES_MAX (sizeof(quic_like_header_t) + MAX_PAYLOAD)   // tope de un PKT_FRAMES
+
+// Bytes que ocupa un mensaje en el cable. Como varios mensajes comparten datagrama, la
+// ventana de congestión cuenta frames y no paquetes.
+static uint32_t msg_wire(size_t len) {
+    return (uint32_t)(len + sizeof(quic_like_frame_t));
+}
+
 // ====== Utilidades ======
 static uint32_t djb2_hash(const char *s) {
     uint32_t h = 5381u;
@@ -65,18 +126,67 @@ static uint32_t djb2_hash(const char *s) {
     return h;
 }
 
+// XOR con la clave repetida en cada byte. Se recorre de a 32, 16 u 8 bytes según lo que
+// soporte la CPU (se elige una vez, en la primera llamada) y el resto byte a byte.
+static size_t xor_words(char *data, size_t len, unsigned char key) {
+    uint64_t k = 0x0101010101010101ull * key;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        w ^= k;
+        memcpy(data + i, &w, 8);
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t xor_avx2(char *data, size_t len, unsigned char key) {
+    __m256i k = _mm256_set1_epi8((char)key);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(v, k));
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static size_t xor_sse2(char *data, size_t len, unsigned char key) {
+    __m128i k = _mm_set1_epi8((char)key);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, k));
+    }
+    return i;
+}
+#endif
+
+static size_t (*xor_wide)(char *, size_t, unsigned char);
+
 void xor_cipher(char *data, size_t len, unsigned char key) {
-    for (size_t i = 0; i < len; i++) data[i] ^= key;
+    if (!xor_wide) {
+        xor_wide = xor_words;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) xor_wide = xor_avx2;
+        else if (__builtin_cpu_supports("sse2")) xor_wide = xor_sse2;
+#endif
+    }
+    size_t i = xor_wide(data, len, key);
+    i += xor_words(data + i, len - i, key);
+    for (; i < len; i++) data[i] ^= key;
 }
 
-static int send_pkt(int sock, const struct sockaddr_in *addr,
-                    pkt_type_t type, uint8_t flags, uint32_t stream_id,
-                    uint64_t seq, const void *payload, uint32_t length,
-                    unsigned char key, int encrypt)
+// Arma encabezado + payload (cifrado si encrypt) en buffer. Devuelve el tamaño o -1.
+static int build_pkt(char *buffer, pkt_type_t type, uint8_t flags, uint32_t stream_id,
+                     uint64_t seq, const void *payload, uint32_t length,
+                     unsigned char key, int encrypt)
 {
     if (length > MAX_PAYLOAD) return -1;
 
-    char buffer[BUFFER_SIZE];
     quic_like_header_t hdr;
 
     hdr.magic = htonl(MAGIC);
@@ -94,19 +204,26 @@ static int send_pkt(int sock, const struct sockaddr_in *addr,
         if (encrypt) xor_cipher(buffer + sizeof(hdr), length, key);
     }
 
-    size_t total = sizeof(hdr) + length;
-    ssize_t sent = sendto(sock, buffer, total, 0,
+    return (int)(sizeof(hdr) + length);
+}
+
+static int send_pkt(int sock, const struct sockaddr_in *addr,
+                    pkt_type_t type, uint8_t flags, uint32_t stream_id,
+                    uint64_t seq, const void *payload, uint32_t length,
+                    unsigned char key, int encrypt)
+{
+    char buffer[BUFFER_SIZE];
+    int total = build_pkt(buffer, type, flags, stream_id, seq, payload, length, key, encrypt);
+    if (total < 0) return -1;
+    ssize_t sent = sendto(sock, buffer, (size_t)total, 0,
                           (const struct sockaddr*)addr, sizeof(*addr));
     return (sent == (ssize_t)total) ? 0 : -1;
 }
 
-static int recv_pkt(int sock, struct sockaddr_in *from, quic_like_header_t *out_hdr,
-                    char *payload_buf, size_t payload_cap, unsigned char key, int decrypt)
+// Valida y decodifica un datagrama ya recibido (n bytes en buffer).
+static int parse_pkt(const char *buffer, ssize_t n, quic_like_header_t *out_hdr,
+                     char *payload_buf, size_t payload_cap, unsigned char key, int decrypt)
 {
-    char buffer[BUFFER_SIZE];
-    socklen_t flen = sizeof(*from);
-    ssize_t n = recvfrom(sock, buffer, sizeof(buffer), 0,
-                         (struct sockaddr*)from, &flen);
     if (n < 0) return -1;
     if ((size_t)n < sizeof(quic_like_header_t)) {
         errno = EPROTO;
@@ -144,28 +261,265 @@ static int recv_pkt(int sock, struct sockaddr_in *from, quic_like_header_t *out_
     return (int)length;
 }
 
+// ====== Envío por tandas (sendmmsg) ======
+// Los paquetes se arman una sola vez en tx_pool y cada destino es una entrada de tx_msgs
+// que apunta a ese mismo buffer: el fan-out de una publicación a N suscriptores es un
+// solo paquete y N entradas del vector, que salen juntas en un sendmmsg().
+static char               tx_pool[TX_POOL][BUFFER_SIZE];
+static int                tx_pool_used;
+static struct mmsghdr     tx_msgs[TX_BATCH];
+static struct iovec       tx_iov[TX_BATCH];
+static struct sockaddr_in tx_addr[TX_BATCH];
+static int                tx_count;
+static unsigned           tx_gen = 1;    // cambia en cada sendmmsg(): invalida paquetes abiertos
+
+static void tx_flush(int sock) {
+    int done = 0;
+    while (done < tx_count) {
+        int r = sendmmsg(sock, tx_msgs + done, (unsigned)(tx_count - done), 0);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) continue;
+            done++;   // se descarta ese datagrama; NACK/retransmisión lo recupera
+            continue;
+        }
+        done += r;
+    }
+    tx_count = 0;
+    tx_gen++;
+}
+
+// Buffer para armar un paquete nuevo. Si el pool se agotó se envía todo lo pendiente primero.
+static char *tx_alloc(int sock) {
+    if (tx_pool_used == TX_POOL) {
+        tx_flush(sock);
+        tx_pool_used = 0;
+    }
+    return tx_pool[tx_pool_used++];
+}
+
+// Agrega un destino para un paquete armado en tx_pool.
+static void tx_push(int sock, const struct sockaddr_in *addr, char *pkt, size_t len) {
+    if (tx_count == TX_BATCH) tx_flush(sock);
+    tx_addr[tx_count] = *addr;
+    tx_iov[tx_count].iov_base = pkt;
+    tx_iov[tx_count].iov_len = len;
+    memset(&tx_msgs[tx_count].msg_hdr, 0, sizeof(struct msghdr));
+    tx_msgs[tx_count].msg_hdr.msg_name = &tx_addr[tx_count];
+    tx_msgs[tx_count].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    tx_msgs[tx_count].msg_hdr.msg_iov = &tx_iov[tx_count];
+    tx_msgs[tx_count].msg_hdr.msg_iovlen = 1;
+    tx_count++;
+}
+
+// Fin de la vuelta del loop: sale todo lo acumulado y el pool queda libre.
+static void tx_end(int sock) {
+    tx_flush(sock);
+    tx_pool_used = 0;
+}
+
+// ====== Temporizadores ======
+// Min-heap de deadlines (ms de reloj monotónico). Cada temporizador va embebido en su
+// dueño y sabe su posición en el heap, así armar/cancelar es O(log n) y en cada vuelta
+// sólo se atienden los que vencieron. El loop duerme en select() hasta el más próximo.
+typedef struct qtimer {
+    uint64_t when;                       // deadline en ms
+    int      heap_pos;                   // -1 = desarmado
+    void   (*fire)(int sock, struct qtimer *t);
+} qtimer_t;
+
+static qtimer_t **timer_heap;
+static int        n_timers, timers_cap;
+static uint64_t   loop_now;              // hora de la vuelta actual del loop (ms)
+static uint64_t   wall_offset;           // reloj de pared - monotónico (ms), fijado al arrancar
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static void heap_set(int i, qtimer_t *t) {
+    timer_heap[i] = t;
+    t->heap_pos = i;
+}
+
+static void heap_up(int i) {
+    qtimer_t *t = timer_heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (timer_heap[parent]->when <= t->when) break;
+        heap_set(i, timer_heap[parent]);
+        i = parent;
+    }
+    heap_set(i, t);
+}
+
+static void heap_down(int i) {
+    qtimer_t *t = timer_heap[i];
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= n_timers) break;
+        if (c + 1 < n_timers && timer_heap[c + 1]->when < timer_heap[c]->when) c++;
+        if (t->when <= timer_heap[c]->when) break;
+        heap_set(i, timer_heap[c]);
+        i = c;
+    }
+    heap_set(i, t);
+}
+
+static void timer_init(qtimer_t *t, void (*fire)(int, qtimer_t *)) {
+    t->when = 0;
+    t->heap_pos = -1;
+    t->fire = fire;
+}
+
+static void timer_cancel(qtimer_t *t) {
+    int i = t->heap_pos;
+    if (i < 0) return;
+    t->heap_pos = -1;
+    qtimer_t *last = timer_heap[--n_timers];
+    if (i == n_timers) return;
+    heap_set(i, last);
+    heap_up(i);
+    heap_down(last->heap_pos);
+}
+
+// Arma (o re-arma) el temporizador para el instante 'when' (ms).
+static int timer_arm(qtimer_t *t, uint64_t when) {
+    if (t->heap_pos >= 0) {
+        t->when = when;
+        heap_up(t->heap_pos);
+        heap_down(t->heap_pos);
+        return 0;
+    }
+    if (n_timers == timers_cap) {
+        int ncap = timers_cap ? timers_cap * 2 : 64;
+        qtimer_t **nh = realloc(timer_heap, (size_t)ncap * sizeof(*nh));
+        if (!nh) return -1;
+        timer_heap = nh;
+        timers_cap = ncap;
+    }
+    t->when = when;
+    heap_set(n_timers, t);
+    heap_up(n_timers++);
+    return 0;
+}
+
+// Milisegundos hasta el próximo deadline; -1 si no hay ninguno armado.
+static int64_t timer_next_ms(void) {
+    if (n_timers == 0) return -1;
+    return timer_heap[0]->when > loop_now ? (int64_t)(timer_heap[0]->when - loop_now) : 0;
+}
+
+// Dispara los temporizadores vencidos. Se desarman antes de llamar a fire(),
+// que puede volver a armarlos.
+static void timers_run(int sock) {
+    while (n_timers > 0 && timer_heap[0]->when <= loop_now) {
+        qtimer_t *t = timer_heap[0];
+        timer_cancel(t);
+        t->fire(sock, t);
+    }
+}
+
 // ====== Modelo de datos ======
+// Historial de un stream: los payloads van seguidos en un anillo de bytes y un índice
+// por secuencia (seq % idx_cap) dice dónde está cada uno. Así la memoria depende de los
+// bytes publicados y no de MAX_PAYLOAD por mensaje. Ambos arreglos empiezan chicos y se
+// duplican hasta hist_count / hist_bytes; a partir de ahí lo nuevo pisa lo más viejo.
 typedef struct {
-    uint64_t seq;
-    uint32_t stream_id;
+    uint64_t seq;                 // 0 = vacío (las seq empiezan en 1)
+    uint64_t off;                 // posición absoluta del payload en el anillo de bytes
+    uint64_t ts_ms;               // hora de publicación (ms desde epoch), para SUB desde una hora
     uint16_t len;
     uint8_t  flags;
-    char     data[MAX_PAYLOAD];
-} msg_record_t;
+    uint8_t  klen;                // largo de la clave (0 = sin clave o sin --compact)
+    uint32_t key_hash;
+} msg_index_t;
 
 typedef struct {
     uint32_t stream_id;
     uint64_t next_seq;            // siguiente seq a emitir
-    msg_record_t history[HISTORY_DEPTH];
-    size_t head;                  // apunta al próximo slot donde escribir
-    size_t size;                  // cuántos válidos hay (<= HISTORY_DEPTH)
+    msg_index_t *index;           // idx_cap entradas, indexado por seq % idx_cap
+    char        *bytes;           // anillo de byte_cap bytes
+    size_t   idx_cap, byte_cap;
+    uint64_t wpos;                // total escrito en el anillo (posición absoluta)
+    uint64_t lo_seq;              // menor seq que puede seguir guardada
+    uint64_t hi_seq;              // mayor seq guardada (0 = vacío)
+    uint32_t avg_wire;            // tamaño medio de un mensaje como frame (bytes en vuelo)
+    // Último mensaje con F_RETAIN (cifrado con BROKER_KEY como el historial), 0 = ninguno
+    uint64_t retained_seq;
+    char    *retained;
+    uint16_t retained_len;
+    // Suscriptores del stream: publicar recorre sólo esta lista
+    struct sub_ref *subs;
+    int      n_subs, subs_cap;
+    // Compactación (--compact): última seq de cada clave y lo que dejaron los reemplazados
+    struct key_slot *keys;
+    size_t   key_cap, key_used;
+    uint64_t dead_bytes;          // bytes de mensajes reemplazados que siguen en el anillo
+    uint64_t n_dead;              // mensajes reemplazados desde la última compactación
 } stream_state_t;
 
+// Entrada de la lista de suscriptores de un stream: índice del cliente y posición de
+// esta suscripción en su arreglo subs[], para borrar en O(1) desde ambos lados.
+struct sub_ref {
+    uint16_t client;
+    uint16_t slot;
+};
+
+// Tabla de claves de un stream (direccionamiento abierto). Una entrada cuya seq ya no está
+// en el historial (o es de otra clave) se puede reutilizar; seq 0 = nunca usada.
+struct key_slot {
+    uint32_t hash;
+    uint64_t seq;
+};
+
+static size_t hist_count = HISTORY_DEPTH;
+static size_t hist_bytes = HISTORY_BYTES;
+static int compact_mode = 0;      // --compact
+
+// Estado de confirmación de una suscripción (qué confirmó el suscriptor de ese stream).
+// Lo que está en (acked, sent_hi] y no aparece en sack[] sigue en vuelo.
+typedef struct {
+    uint64_t acked;               // todo seq <= acked confirmado (ACK acumulado)
+    uint64_t largest_acked;       // mayor seq confirmada (acumulado o SACK)
+    uint64_t sent_hi;             // mayor seq enviada a este suscriptor
+    uint64_t rtx_hi;              // mayor seq retransmitida: con esas no se mide RTT (Karn)
+    uint64_t sack[ACK_MAX_RANGES][2];  // últimos rangos SACK recibidos [a, b]
+    int      n_sack;
+    uint64_t base;                // seq publicada al suscribirse; lo anterior es backlog
+    uint64_t rtx_from, rtx_to;    // retransmisión pedida por NACK pendiente (0 = nada)
+    uint64_t timed_seq, timed_ms; // seq cronometrada para el RTT (una por RTT, 0 = ninguna)
+} sub_ack_t;
+
 typedef struct {
     struct sockaddr_in addr;
-    uint32_t streams[8];          // hasta 8 suscripciones por cliente (simple)
+    stream_state_t *subs[CLIENT_MAX_SUBS];  // streams suscritos
+    int      sub_pos[CLIENT_MAX_SUBS];      // posición del cliente en subs[i]->subs
+    sub_ack_t ack[CLIENT_MAX_SUBS];         // confirmaciones por suscripción
     size_t   n_streams;
-    time_t   last_seen;
+    uint64_t last_seen;                     // ms (reloj monotónico)
+    qtimer_t expiry;                        // purga por inactividad
+    qtimer_t keepalive;                     // PING si está callado
+    // RTT (RFC 6298 / RFC 9002) y PTO del cliente
+    uint64_t srtt, rttvar;                  // ms
+    int      have_rtt;
+    int      pto_count;                     // PTO seguidos sin progreso (backoff)
+    uint64_t last_send;                     // último DATA enviado (ms)
+    qtimer_t pto;
+    // Control de congestión NewReno (en bytes) y pacing por token bucket
+    uint32_t cwnd, ssthresh, ca_acc;
+    uint32_t in_flight;                     // bytes sin confirmar (todas las suscripciones)
+    uint64_t recovery_until;                // no se vuelve a reducir hasta acá (ms)
+    double   tokens;                        // bytes que el pacer deja salir ya
+    uint64_t tokens_ts;
+    size_t   rr;                            // round-robin entre suscripciones
+    qtimer_t pacer;
+    // Paquete que ya le sale en esta tanda: los mensajes siguientes se le agregan como frames
+    unsigned co_gen;                        // tanda (tx_gen) del paquete; si cambió, ya salió
+    int      co_tx;                         // su entrada en tx_msgs
+    char    *co_buf;                        // NULL = todavía es un paquete de un solo mensaje
+    size_t   co_len;                        // tamaño que tiene (o tendría) como PKT_FRAMES
     int      active;
 } client_t;
 
@@ -173,16 +527,101 @@ static client_t clients[MAX_CLIENTS];
 static stream_state_t streams[MAX_STREAMS];
 static size_t n_streams = 0;
 
+// Tablas hash de direccionamiento abierto (sondeo lineal) sobre los arreglos de arriba.
+// Guardan índice+1; 0 = bucket vacío.
+static uint16_t client_tab[CLIENT_TAB];
+static uint16_t stream_tab[STREAM_TAB];
+static uint16_t client_free[MAX_CLIENTS];   // pila de slots libres de clients[]
+static size_t   n_client_free;
+
+static size_t stream_home(uint32_t sid) {
+    return (size_t)((sid * 2654435761u) >> 7) & (STREAM_TAB - 1);
+}
+
+static size_t client_home(const struct sockaddr_in *a) {
+    uint32_t h = (uint32_t)a->sin_addr.s_addr * 2654435761u;
+    h ^= (uint32_t)a->sin_port * 40503u;
+    return (size_t)(h ^ (h >> 15)) & (CLIENT_TAB - 1);
+}
+
+// ====== Paquetes con varios frames ======
+// El primer mensaje de la tanda para un cliente sale como paquete normal (y puede ser el
+// paquete compartido del fan-out). Si en la misma tanda le toca otro, ese paquete se pasa
+// a un PKT_FRAMES propio y los siguientes se le agregan hasta llenar el datagrama: una
+// ráfaga de mensajes chicos ocupa pocos datagramas y pocas entradas del sendmmsg().
+static int co_room(const client_t *cl, size_t plen) {
+    return cl->co_gen == tx_gen && cl->co_len + sizeof(quic_like_frame_t) + plen <= FRAMES_MAX;
+}
+
+// Agrega un frame al PKT_FRAMES abierto de cl. El payload se cifra acá salvo que ya venga cifrado.
+static void co_frame(client_t *cl, uint8_t type, uint8_t flags, uint32_t stream_id_net,
+                     uint64_t seq_net, const char *payload, size_t plen, int encrypted)
+{
+    quic_like_frame_t f;
+    f.type = type;
+    f.flags = flags;
+    f.length = htons((uint16_t)plen);
+    f.stream_id = stream_id_net;
+    f.seq = seq_net;
+    char *dst = cl->co_buf + cl->co_len;
+    memcpy(dst, &f, sizeof(f));
+    xor_cipher(dst, sizeof(f), BROKER_KEY);
+    memcpy(dst + sizeof(f), payload, plen);
+    if (!encrypted) xor_cipher(dst + sizeof(f), plen, BROKER_KEY);
+    cl->co_len += sizeof(f) + plen;
+
+    quic_like_header_t *h = (quic_like_header_t *)cl->co_buf;
+    h->length = htonl((uint32_t)(cl->co_len - sizeof(*h)));
+    tx_iov[cl->co_tx].iov_len = cl->co_len;
+}
+
+// Agrega a los frames de cl un paquete ya armado (encabezado + payload cifrado).
+static void co_frame_pkt(client_t *cl, const char *pkt, size_t len) {
+    quic_like_header_t h;
+    memcpy(&h, pkt, sizeof(h));
+    co_frame(cl, h.type, h.flags, h.stream_id, h.seq, pkt + sizeof(h), len - sizeof(h), 1);
+}
+
+// Convierte el paquete de un solo mensaje que ya tiene cl en la tanda en un PKT_FRAMES.
+static int co_open(int sock, client_t *cl) {
+    char *buf = tx_alloc(sock);
+    if (cl->co_gen != tx_gen) return -1;   // tx_alloc tuvo que vaciar la tanda: ya salió
+    const char *first = tx_iov[cl->co_tx].iov_base;
+    size_t first_len = tx_iov[cl->co_tx].iov_len;
+    build_pkt(buf, PKT_FRAMES, 0, 0, 0, NULL, 0, BROKER_KEY, 1);
+    cl->co_buf = buf;
+    cl->co_len = sizeof(quic_like_header_t);
+    tx_iov[cl->co_tx].iov_base = buf;
+    co_frame_pkt(cl, first, first_len);
+    return 0;
+}
+
+// Manda a cl un paquete ya armado (de un solo mensaje, quizá compartido con otros destinos).
+static void tx_to_client(int sock, client_t *cl, char *pkt, size_t len) {
+    if (co_room(cl, len - sizeof(quic_like_header_t)) && (cl->co_buf || co_open(sock, cl) == 0)) {
+        co_frame_pkt(cl, pkt, len);
+        return;
+    }
+    tx_push(sock, &cl->addr, pkt, len);
+    cl->co_gen = tx_gen;
+    cl->co_tx = tx_count - 1;
+    cl->co_buf = NULL;
+    cl->co_len = len + sizeof(quic_like_frame_t);
+}
+
 // Buscar/crear stream
 static stream_state_t* get_stream(uint32_t sid) {
-    for (size_t i = 0; i < n_streams; ++i) {
-        if (streams[i].stream_id == sid) return &streams[i];
+    size_t i = stream_home(sid);
+    while (stream_tab[i]) {
+        stream_state_t *st = &streams[stream_tab[i] - 1];
+        if (st->stream_id == sid) return st;
+        i = (i + 1) & (STREAM_TAB - 1);
     }
     if (n_streams >= MAX_STREAMS) return NULL;
+    memset(&streams[n_streams], 0, sizeof(stream_state_t));   // historial se reserva al primer mensaje
     streams[n_streams].stream_id = sid;
     streams[n_streams].next_seq = 1;
-    streams[n_streams].head = 0;
-    streams[n_streams].size = 0;
+    stream_tab[i] = (uint16_t)(n_streams + 1);
     return &streams[n_streams++];
 }
 
@@ -193,103 +632,816 @@ static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b) {
            a->sin_addr.s_addr == b->sin_addr.s_addr;
 }
 
+static void clients_init(void) {
+    memset(clients, 0, sizeof(clients));
+    memset(client_tab, 0, sizeof(client_tab));
+    n_client_free = 0;
+    for (size_t i = MAX_CLIENTS; i-- > 0; ) client_free[n_client_free++] = (uint16_t)i;
+}
+
+static void client_expiry_fire(int sock, qtimer_t *t);
+static void client_keepalive_fire(int sock, qtimer_t *t);
+static void client_pto_fire(int sock, qtimer_t *t);
+static void client_pacer_fire(int sock, qtimer_t *t);
+
 // Buscar/crear cliente
 static client_t* get_client(const struct sockaddr_in *addr) {
-    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].active && same_addr(&clients[i].addr, addr)) {
-            return &clients[i];
-        }
+    size_t i = client_home(addr);
+    while (client_tab[i]) {
+        client_t *cl = &clients[client_tab[i] - 1];
+        if (same_addr(&cl->addr, addr)) return cl;
+        i = (i + 1) & (CLIENT_TAB - 1);
     }
-    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
-        if (!clients[i].active) {
-            clients[i].active = 1;
-            clients[i].addr = *addr;
-            clients[i].n_streams = 0;
-            clients[i].last_seen = time(NULL);
-            return &clients[i];
-        }
+    if (n_client_free == 0) return NULL;
+    uint16_t idx = client_free[--n_client_free];
+    client_t *cl = &clients[idx];
+    memset(cl, 0, sizeof(*cl));
+    cl->active = 1;
+    cl->addr = *addr;
+    cl->last_seen = loop_now;
+    client_tab[i] = (uint16_t)(idx + 1);
+    timer_init(&cl->expiry, client_expiry_fire);
+    timer_init(&cl->keepalive, client_keepalive_fire);
+    timer_init(&cl->pto, client_pto_fire);
+    timer_init(&cl->pacer, client_pacer_fire);
+    cl->cwnd = CWND_INIT;
+    cl->ssthresh = CWND_MAX;
+    cl->tokens = PACING_BURST * CC_MSS;
+    cl->tokens_ts = loop_now;
+    timer_arm(&cl->expiry, loop_now + KEEPALIVE_CLIENT_S * 1000u);
+    timer_arm(&cl->keepalive, loop_now + PING_IDLE_S * 1000u);
+    return cl;
+}
+
+// Saca al cliente de la tabla hash. Con sondeo lineal no se dejan marcas de borrado:
+// los elementos siguientes del mismo grupo se corren hacia atrás si les corresponde.
+static void client_tab_remove(size_t idx) {
+    size_t i = client_home(&clients[idx].addr);
+    while (client_tab[i] && client_tab[i] != idx + 1) i = (i + 1) & (CLIENT_TAB - 1);
+    if (!client_tab[i]) return;
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & (CLIENT_TAB - 1);
+        if (!client_tab[j]) break;
+        size_t k = client_home(&clients[client_tab[j] - 1].addr);
+        // El de j se queda si su bucket ideal k está (cíclicamente) en (i, j]
+        int stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (stays) continue;
+        client_tab[i] = client_tab[j];
+        i = j;
     }
-    return NULL;
+    client_tab[i] = 0;
 }
 
-static int client_subscribe(client_t *cl, uint32_t sid) {
+static uint64_t stream_start_seq(const stream_state_t *st, const char *from);
+
+// Suscribe al cliente al stream sid desde la posición 'from' (ver stream_start_seq). El
+// backlog no tiene camino aparte: la suscripción arranca con sent_hi antes del final del
+// historial y el pacer lo manda como mensajes nuevos hasta alcanzar lo publicado en vivo,
+// en la misma secuencia y sin huecos. En *start queda la primera seq que va a recibir.
+static int client_subscribe(client_t *cl, uint32_t sid, const char *from, uint64_t *start) {
     if (!cl) return -1;
+    stream_state_t *st = get_stream(sid);
+    if (!st) return -1;
     for (size_t i = 0; i < cl->n_streams; ++i) {
-        if (cl->streams[i] == sid) return 0; // ya suscrito
+        if (cl->subs[i] == st) { // ya suscrito
+            *start = cl->ack[i].acked + 1;
+            return 0;
+        }
+    }
+    if (cl->n_streams >= CLIENT_MAX_SUBS) return -1;
+    if (st->n_subs == st->subs_cap) {
+        int ncap = st->subs_cap ? st->subs_cap * 2 : 4;
+        struct sub_ref *nv = realloc(st->subs, (size_t)ncap * sizeof(*nv));
+        if (!nv) return -1;
+        st->subs = nv;
+        st->subs_cap = ncap;
     }
-    if (cl->n_streams >= 8) return -1;
-    cl->streams[cl->n_streams++] = sid;
-    cl->last_seen = time(NULL);
+    st->subs[st->n_subs].client = (uint16_t)(cl - clients);
+    st->subs[st->n_subs].slot = (uint16_t)cl->n_streams;
+    cl->subs[cl->n_streams] = st;
+    cl->sub_pos[cl->n_streams] = st->n_subs++;
+    // Se empieza a contar desde 'from': lo anterior sólo llega por NACK
+    *start = stream_start_seq(st, from);
+    memset(&cl->ack[cl->n_streams], 0, sizeof(sub_ack_t));
+    cl->ack[cl->n_streams].acked = *start - 1;
+    cl->ack[cl->n_streams].largest_acked = *start - 1;
+    cl->ack[cl->n_streams].sent_hi = *start - 1;
+    cl->ack[cl->n_streams].base = *start - 1;
+    cl->n_streams++;
+    if (*start < st->next_seq) timer_arm(&cl->pacer, loop_now);   // hay backlog: lo empieza el pacer
     return 0;
 }
 
-static int client_is_subscribed(const client_t *cl, uint32_t sid) {
-    for (size_t i = 0; i < cl->n_streams; ++i)
-        if (cl->streams[i] == sid) return 1;
+// Quita la suscripción 'slot' del cliente (swap-remove en ambos arreglos).
+static void client_unsubscribe(client_t *cl, size_t slot) {
+    stream_state_t *st = cl->subs[slot];
+    int pos = cl->sub_pos[slot];
+
+    struct sub_ref last = st->subs[--st->n_subs];
+    if (pos != st->n_subs) {
+        st->subs[pos] = last;
+        clients[last.client].sub_pos[last.slot] = pos;
+    }
+
+    size_t lastslot = --cl->n_streams;
+    if (slot != lastslot) {
+        cl->subs[slot] = cl->subs[lastslot];
+        cl->sub_pos[slot] = cl->sub_pos[lastslot];
+        cl->ack[slot] = cl->ack[lastslot];
+        cl->subs[slot]->subs[cl->sub_pos[slot]].slot = (uint16_t)slot;
+    }
+}
+
+static void client_remove(client_t *cl) {
+    while (cl->n_streams > 0) client_unsubscribe(cl, cl->n_streams - 1);
+    timer_cancel(&cl->expiry);
+    timer_cancel(&cl->keepalive);
+    timer_cancel(&cl->pto);
+    timer_cancel(&cl->pacer);
+    size_t idx = (size_t)(cl - clients);
+    client_tab_remove(idx);
+    cl->active = 0;
+    client_free[n_client_free++] = (uint16_t)idx;
+}
+
+// Los paquetes sólo actualizan last_seen; no se toca el heap por paquete. Cuando vence
+// el temporizador se mira last_seen: si hubo actividad se re-arma desde ahí.
+static void client_expiry_fire(int sock, qtimer_t *t) {
+    (void)sock;
+    client_t *cl = (client_t *)((char *)t - offsetof(client_t, expiry));
+    uint64_t deadline = cl->last_seen + KEEPALIVE_CLIENT_S * 1000u;
+    if (deadline > loop_now) {
+        timer_arm(t, deadline);
+        return;
+    }
+    client_remove(cl);
+}
+
+static void client_keepalive_fire(int sock, qtimer_t *t) {
+    client_t *cl = (client_t *)((char *)t - offsetof(client_t, keepalive));
+    uint64_t deadline = cl->last_seen + PING_IDLE_S * 1000u;
+    if (deadline > loop_now) {
+        timer_arm(t, deadline);
+        return;
+    }
+    // Sólo a suscriptores: responden PONG y eso renueva last_seen
+    if (cl->n_streams > 0) {
+        const char ping[] = "PING";
+        char *pkt = tx_alloc(sock);
+        int plen = build_pkt(pkt, PKT_PING, 0, 0, 0, ping, (uint32_t)strlen(ping), BROKER_KEY, 1);
+        if (plen > 0) tx_to_client(sock, cl, pkt, (size_t)plen);
+    }
+    timer_arm(t, loop_now + PING_IDLE_S * 1000u);
+}
+
+// Entrada de la secuencia seq, o NULL si ya salió de la ventana, fue pisada o nunca se guardó.
+static const msg_index_t *stream_find(const stream_state_t *st, uint64_t seq) {
+    if (st->hi_seq == 0 || seq < st->lo_seq || seq > st->hi_seq) return NULL;
+    const msg_index_t *e = &st->index[seq % st->idx_cap];
+    if (e->seq != seq) return NULL;
+    if (st->wpos - e->off > st->byte_cap) return NULL;   // sus bytes ya se reescribieron
+    return e;
+}
+
+// Payload guardado de e (cifrado con BROKER_KEY)
+static const char *stream_data(const stream_state_t *st, const msg_index_t *e) {
+    return st->bytes + e->off % st->byte_cap;
+}
+
+// 1 si e es un fragmento que no es el primero de su mensaje (offset != 0). Sólo hace
+// falta descifrar el encabezado del fragmento: msg_id(8) total(4) offset(4).
+static int frag_tail(const stream_state_t *st, const msg_index_t *e) {
+    if (!(e->flags & F_FRAG) || e->len < 16) return 0;
+    char h[16];
+    uint32_t off;
+    memcpy(h, stream_data(st, e), sizeof(h));
+    xor_cipher(h, sizeof(h), BROKER_KEY);
+    memcpy(&off, h + 12, sizeof(off));
+    return ntohl(off) != 0;
+}
+
+// Primera seq a mandar a una suscripción nueva según 'from': NULL o "latest" = sólo lo que
+// se publique de acá en más; "earliest" = lo más viejo del historial; "<seq>" = desde esa
+// seq; "@<ms>" = desde lo publicado a partir de esa hora (ms desde epoch). Lo que ya salió
+// del historial no se puede mandar: se empieza por lo más viejo que quede.
+static uint64_t stream_start_seq(const stream_state_t *st, const char *from) {
+    if (!from || !*from || strcmp(from, "latest") == 0 || st->hi_seq == 0) return st->next_seq;
+    uint64_t start;
+    if (strcmp(from, "earliest") == 0) {
+        start = st->lo_seq;
+    } else if (from[0] == '@') {
+        uint64_t ts = strtoull(from + 1, NULL, 10);
+        start = st->next_seq;
+        for (uint64_t s = st->lo_seq; s <= st->hi_seq; ++s) {
+            const msg_index_t *e = stream_find(st, s);
+            if (e && e->ts_ms >= ts) {
+                start = s;
+                break;
+            }
+        }
+    } else {
+        start = strtoull(from, NULL, 10);
+    }
+    if (start < st->lo_seq) start = st->lo_seq;
+    if (start > st->next_seq) start = st->next_seq;
+    // No se empieza a mitad de un mensaje fragmentado: se retrocede hasta su primer fragmento
+    const msg_index_t *e;
+    while (start > st->lo_seq && (e = stream_find(st, start)) && frag_tail(st, e)) start--;
+    return start;
+}
+
+// Posición absoluta donde quedaría un payload de len bytes. Cada payload va contiguo:
+// si no entra antes del final del anillo se salta al principio.
+static uint64_t ring_place(const stream_state_t *st, size_t len) {
+    uint64_t pos = st->wpos;
+    size_t in = (size_t)(pos % st->byte_cap);
+    if (in + len > st->byte_cap) pos += st->byte_cap - in;
+    return pos;
+}
+
+// Cambia el historial a ncount entradas / nbytes bytes (no achica), compactando lo vigente.
+static int stream_resize(stream_state_t *st, size_t ncount, size_t nbytes) {
+    msg_index_t *ni = calloc(ncount, sizeof(msg_index_t));
+    char *nb = malloc(nbytes);
+    if (!ni || !nb) {
+        free(ni);
+        free(nb);
+        return -1;
+    }
+    // Lo vigente ocupa a lo sumo byte_cap <= nbytes, así que entra sin dar la vuelta
+    uint64_t w = 0;
+    for (uint64_t s = st->lo_seq; st->hi_seq && s <= st->hi_seq; ++s) {
+        const msg_index_t *e = stream_find(st, s);
+        if (!e) continue;
+        memcpy(nb + w, stream_data(st, e), e->len);
+        ni[s % ncount] = *e;
+        ni[s % ncount].off = w;
+        w += e->len;
+    }
+    free(st->index);
+    free(st->bytes);
+    st->index = ni;
+    st->bytes = nb;
+    st->idx_cap = ncount;
+    st->byte_cap = nbytes;
+    st->wpos = w;
+    st->dead_bytes = 0;       // los reemplazados no se copiaron
+    st->n_dead = 0;
     return 0;
 }
 
-static void purge_inactive_clients(void) {
-    time_t now = time(NULL);
-    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].active && (now - clients[i].last_seen > KEEPALIVE_CLIENT_S)) {
-            clients[i].active = 0;
+static size_t grow_cap(size_t cur, size_t init, size_t max) {
+    size_t n = cur ? cur * 2 : init;
+    return n > max ? max : n;
+}
+
+// ====== Compactación por clave ======
+// Largo de la clave de un payload (hasta el primer ':' inclusive), 0 si no tiene.
+static uint8_t key_len(const char *data, uint16_t len) {
+    const char *c = memchr(data, ':', len < KEY_MAX ? len : KEY_MAX);
+    return c ? (uint8_t)(c - data + 1) : 0;
+}
+
+static uint32_t key_hash(const char *key, uint8_t klen) {
+    uint32_t h = 2166136261u;   // FNV-1a
+    for (uint8_t i = 0; i < klen; ++i) h = (h ^ (unsigned char)key[i]) * 16777619u;
+    return h;
+}
+
+// 1 si la entrada guardada e tiene la clave key. El historial está cifrado: se descifra
+// sólo el largo de la clave.
+static int key_equal(const stream_state_t *st, const msg_index_t *e, const char *key, uint8_t klen) {
+    if (e->klen != klen) return 0;
+    char k[KEY_MAX];
+    memcpy(k, stream_data(st, e), klen);
+    xor_cipher(k, klen, BROKER_KEY);
+    return memcmp(k, key, klen) == 0;
+}
+
+// Rehace la tabla con las claves vigentes del historial, con lugar para el doble
+static int key_rebuild(stream_state_t *st) {
+    size_t live = 0;
+    for (uint64_t s = st->lo_seq; st->hi_seq && s <= st->hi_seq; ++s) {
+        const msg_index_t *e = stream_find(st, s);
+        if (e && e->klen) live++;
+    }
+    size_t cap = 16;
+    while (cap < 4 * (live + 1)) cap *= 2;
+    struct key_slot *t = calloc(cap, sizeof(*t));
+    if (!t) return -1;
+    for (uint64_t s = st->lo_seq; st->hi_seq && s <= st->hi_seq; ++s) {
+        const msg_index_t *e = stream_find(st, s);
+        if (!e || !e->klen) continue;
+        size_t i = e->key_hash & (cap - 1);
+        while (t[i].seq) i = (i + 1) & (cap - 1);
+        t[i].hash = e->key_hash;
+        t[i].seq = s;
+    }
+    free(st->keys);
+    st->keys = t;
+    st->key_cap = cap;
+    st->key_used = live;
+    return 0;
+}
+
+// Lugar de la clave en la tabla. *found = 1 si ya tiene un mensaje vigente (su seq está en
+// el lugar); si no, es el primer lugar libre o reutilizable del recorrido.
+static struct key_slot *key_lookup(stream_state_t *st, uint32_t h, const char *key,
+                                   uint8_t klen, int *found)
+{
+    struct key_slot *reuse = NULL;
+    *found = 0;
+    for (size_t i = h & (st->key_cap - 1);; i = (i + 1) & (st->key_cap - 1)) {
+        struct key_slot *k = &st->keys[i];
+        if (k->seq == 0) return reuse ? reuse : k;
+        const msg_index_t *e = stream_find(st, k->seq);
+        if (!e || !e->klen || e->key_hash != k->hash) {
+            if (!reuse) reuse = k;
+        } else if (k->hash == h && key_equal(st, e, key, klen)) {
+            *found = 1;
+            return k;
         }
     }
 }
 
-// Guardar mensaje en historial del stream
+// Saca una entrada reemplazada del historial. Sus bytes se recuperan en la próxima
+// compactación (stream_resize) y su seq le llega al suscriptor como parte de un F_GAP.
+static void stream_drop(stream_state_t *st, uint64_t seq) {
+    msg_index_t *e = &st->index[seq % st->idx_cap];
+    st->dead_bytes += e->len;
+    st->n_dead++;
+    e->seq = 0;
+    while (st->lo_seq < st->hi_seq && !stream_find(st, st->lo_seq)) st->lo_seq++;
+}
+
+// Guardar mensaje en historial del stream (las seq llegan crecientes)
 static void stream_store(stream_state_t *st, uint64_t seq,
                          const char *data, uint16_t len, uint8_t flags)
 {
-    size_t idx = st->head;
-    st->history[idx].seq = seq;
-    st->history[idx].stream_id = st->stream_id;
-    st->history[idx].len = len;
-    st->history[idx].flags = flags;
-    memcpy(st->history[idx].data, data, len);
+    if (seq == 0 || seq <= st->hi_seq) return;
+
+    if (!st->index &&
+        stream_resize(st, grow_cap(0, HIST_INIT_COUNT, hist_count),
+                      grow_cap(0, HIST_INIT_BYTES, hist_bytes)) < 0) return;
+
+    // Con --compact, el mensaje anterior de la misma clave sale del historial
+    uint8_t klen = 0;
+    uint32_t h = 0;
+    struct key_slot *ks = NULL;
+    if (compact_mode && (flags & F_KEYED) && !(flags & F_FRAG) && (klen = key_len(data, len))) {
+        h = key_hash(data, klen);
+        int found = 0;
+        if ((st->keys && (st->key_used + 1) * 2 <= st->key_cap) || key_rebuild(st) == 0) {
+            ks = key_lookup(st, h, data, klen, &found);
+            if (found) stream_drop(st, ks->seq);
+            else if (ks->seq == 0) st->key_used++;
+        } else {
+            klen = 0;
+        }
+    }
+
+    // Mientras guardar esto desplace algo vigente y quede margen, se duplica lo que falte.
+    // En los topes, si los reemplazados ocupan al menos un cuarto del anillo, se compacta
+    // antes de pisar lo vigente.
+    size_t max_count = compact_mode ? hist_count * COMPACT_SPAN : hist_count;
+    for (;;) {
+        const msg_index_t *lo = st->hi_seq ? stream_find(st, st->lo_seq) : NULL;
+        if (!lo) break;
+        int by_count = seq - st->lo_seq + 1 > st->idx_cap;
+        int by_bytes = ring_place(st, len) + len - lo->off > st->byte_cap;
+        size_t nc = st->idx_cap, nb = st->byte_cap;
+        if (by_count && nc < max_count) nc = grow_cap(nc, HIST_INIT_COUNT, max_count);
+        if (by_bytes && nb < hist_bytes) nb = grow_cap(nb, HIST_INIT_BYTES, hist_bytes);
+        if (nc == st->idx_cap && nb == st->byte_cap &&
+            !(by_bytes && st->dead_bytes >= st->byte_cap / 4)) break;   // en los topes: se pisa
+        if (stream_resize(st, nc, nb) < 0) break;
+    }
+
+    uint64_t pos = ring_place(st, len);
+    // Se guarda ya cifrado (la clave es una sola): reenvíos y fan-out copian sin volver a cifrar
+    memcpy(st->bytes + pos % st->byte_cap, data, len);
+    xor_cipher(st->bytes + pos % st->byte_cap, len, BROKER_KEY);
+    st->wpos = pos + len;
+
+    msg_index_t *e = &st->index[seq % st->idx_cap];
+    e->seq = seq;
+    e->off = pos;
+    e->len = len;
+    e->ts_ms = loop_now + wall_offset;
+    st->avg_wire = st->avg_wire ? (st->avg_wire * 7 + msg_wire(len)) / 8 : msg_wire(len);
+    e->flags = flags;
+    e->klen = klen;
+    e->key_hash = h;
+    if (ks) {
+        ks->hash = h;
+        ks->seq = seq;
+    }
+
+    st->hi_seq = seq;
+    if (st->lo_seq == 0) st->lo_seq = seq;
+    // Avanzar el inicio de la ventana sobre lo que se acaba de pisar
+    while (st->lo_seq < st->hi_seq && !stream_find(st, st->lo_seq)) st->lo_seq++;
+}
+
+// ====== Confirmaciones, RTT y PTO ======
+static int client_sub_slot(const client_t *cl, const stream_state_t *st) {
+    for (size_t i = 0; i < cl->n_streams; ++i)
+        if (cl->subs[i] == st) return (int)i;
+    return -1;
+}
+
+static uint64_t client_pto_ms(const client_t *cl) {
+    uint64_t srtt = cl->have_rtt ? cl->srtt : INITIAL_RTT_MS;
+    uint64_t rttvar = cl->have_rtt ? cl->rttvar : INITIAL_RTT_MS / 2;
+    uint64_t pto = srtt + (4 * rttvar > 1 ? 4 * rttvar : 1) + MAX_ACK_DELAY_MS;
+    return pto << cl->pto_count;
+}
+
+// Se mandó DATA al cliente: si el PTO no está armado, se arma. Si ya lo está no se toca
+// el heap; al vencer mira last_send y se corre si hizo falta.
+static void client_data_sent(client_t *cl) {
+    cl->last_send = loop_now;
+    if (cl->pto.heap_pos < 0) timer_arm(&cl->pto, loop_now + client_pto_ms(cl));
+}
+
+static void rtt_sample(client_t *cl, uint64_t sample) {
+    if (!cl->have_rtt) {
+        cl->srtt = sample;
+        cl->rttvar = sample / 2;
+        cl->have_rtt = 1;
+        return;
+    }
+    uint64_t diff = cl->srtt > sample ? cl->srtt - sample : sample - cl->srtt;
+    cl->rttvar = (3 * cl->rttvar + diff) / 4;
+    cl->srtt = (7 * cl->srtt + sample) / 8;
+}
+
+static int sack_covers(const sub_ack_t *ak, uint64_t seq) {
+    for (int i = 0; i < ak->n_sack; ++i)
+        if (ak->sack[i][0] <= seq && seq <= ak->sack[i][1]) return 1;
+    return 0;
+}
+
+// Mensajes de la suscripción enviados y todavía sin confirmar (ni por acumulado ni por SACK).
+// Si el stream tiene mensajes reemplazados, sus seq (que viajan en un F_GAP) no cuentan.
+static uint64_t sub_in_flight(const stream_state_t *st, const sub_ack_t *ak) {
+    uint64_t n = ak->sent_hi - ak->acked;
+    for (int i = 0; i < ak->n_sack; ++i) {
+        uint64_t a = ak->sack[i][0] > ak->acked ? ak->sack[i][0] : ak->acked + 1;
+        uint64_t b = ak->sack[i][1] < ak->sent_hi ? ak->sack[i][1] : ak->sent_hi;
+        if (b >= a) n = (b - a + 1 < n) ? n - (b - a + 1) : 0;
+    }
+    if (st->n_dead == 0) return n;
+    for (uint64_t s = ak->acked + 1; s <= ak->sent_hi && n > 0; ++s)
+        if (s >= st->lo_seq && !stream_find(st, s) && !sack_covers(ak, s)) n--;
+    return n;
+}
+
+// Bytes en vuelo: los mensajes sin confirmar de cada suscripción por el tamaño medio de su stream
+static void client_recount(client_t *cl) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < cl->n_streams; ++i)
+        n += sub_in_flight(cl->subs[i], &cl->ack[i]) * cl->subs[i]->avg_wire;
+    cl->in_flight = n > UINT32_MAX ? UINT32_MAX : (uint32_t)n;
+}
+
+static uint64_t client_srtt(const client_t *cl) {
+    if (!cl->have_rtt) return INITIAL_RTT_MS;
+    return cl->srtt > 0 ? cl->srtt : 1;
+}
+
+// Pacing: la ventana se reparte en un RTT. Bytes por ms.
+static double pacing_rate(const client_t *cl) {
+    return PACING_GAIN * (double)cl->cwnd / (double)client_srtt(cl);
+}
+
+static void pacer_refill(client_t *cl) {
+    double rate = pacing_rate(cl);
+    // loop_now tiene resolución de 1 ms: el balde debe alcanzar al menos para 2 ms de envío
+    double cap = rate * 2 > PACING_BURST * CC_MSS ? rate * 2 : PACING_BURST * CC_MSS;
+    cl->tokens += rate * (double)(loop_now - cl->tokens_ts);
+    if (cl->tokens > cap) cl->tokens = cap;
+    cl->tokens_ts = loop_now;
+}
+
+// Pérdida (NACK o PTO repetido): NewReno parte la ventana a la mitad, una vez por RTT
+static void congestion_event(client_t *cl) {
+    if (loop_now < cl->recovery_until) return;
+    cl->ssthresh = cl->cwnd / 2 < CWND_MIN ? CWND_MIN : cl->cwnd / 2;
+    cl->cwnd = cl->ssthresh;
+    cl->ca_acc = 0;
+    cl->recovery_until = loop_now + client_srtt(cl);
+}
+
+// Crecimiento con cada confirmación: slow start hasta ssthresh, después un datagrama por ventana
+static void cwnd_on_ack(client_t *cl, uint32_t acked) {
+    if (acked == 0 || loop_now < cl->recovery_until) return;
+    if (cl->cwnd < cl->ssthresh) {
+        cl->cwnd += acked;
+    } else {
+        cl->ca_acc += acked;
+        while (cl->ca_acc >= cl->cwnd) {
+            cl->ca_acc -= cl->cwnd;
+            cl->cwnd += CC_MSS;
+        }
+    }
+    if (cl->cwnd > CWND_MAX) cl->cwnd = CWND_MAX;
+}
+
+static void sub_sent_new(client_t *cl, sub_ack_t *ak, uint64_t seq, size_t len) {
+    ak->sent_hi = seq;
+    cl->in_flight += msg_wire(len);
+    if (!ak->timed_seq) {
+        ak->timed_seq = seq;
+        ak->timed_ms = loop_now;
+    }
+}
+
+// Rango compactado que empieza en from: una entrada de mentira con F_GAP, la seq de su
+// última seq (hasta limit) y como payload from (8 bytes, cifrados como el historial).
+static msg_index_t gap_entry;
+static char gap_data[8];
+
+static const msg_index_t *stream_gap(const stream_state_t *st, uint64_t from, uint64_t limit) {
+    uint64_t to = from;
+    if (limit > st->hi_seq) limit = st->hi_seq;
+    while (to < limit && !stream_find(st, to + 1)) to++;
+    uint64_t be = htobe64(from);
+    memcpy(gap_data, &be, sizeof(be));
+    xor_cipher(gap_data, sizeof(gap_data), BROKER_KEY);
+    gap_entry.seq = to;
+    gap_entry.len = sizeof(gap_data);
+    gap_entry.flags = F_GAP;
+    return &gap_entry;
+}
+
+// Manda un mensaje del historial a la suscripción slot (en la tanda de sendmmsg).
+// rtx != 0: retransmisión (no ocupa ventana nueva, no sirve para medir RTT).
+static void send_from_history(int sock, client_t *cl, int slot, const stream_state_t *st,
+                              const msg_index_t *e, int rtx)
+{
+    const char *data = e == &gap_entry ? gap_data : stream_data(st, e);
+    if (cl->co_buf && co_room(cl, e->len)) {
+        // Ya hay un PKT_FRAMES abierto para cl: el mensaje se arma directo ahí
+        co_frame(cl, PKT_DATA, e->flags, htonl(st->stream_id), htobe64(e->seq),
+                 data, e->len, 1);
+    } else {
+        char *pkt = tx_alloc(sock);
+        int plen = build_pkt(pkt, PKT_DATA, e->flags, st->stream_id, e->seq,
+                             data, e->len, BROKER_KEY, 0);
+        if (plen <= 0) return;
+        tx_to_client(sock, cl, pkt, (size_t)plen);
+    }
+    if (slot < 0) return;
+    sub_ack_t *ak = &cl->ack[slot];
+    if (rtx) {
+        if (e->seq > ak->rtx_hi) ak->rtx_hi = e->seq;
+    } else {
+        sub_sent_new(cl, ak, e->seq, e->len);
+    }
+    client_data_sent(cl);
+}
+
+// Control de flujo: el suscriptor guarda a lo sumo REORDER_WINDOW mensajes por encima de
+// su acumulado y lo que llegue más arriba lo hace dar por perdido lo que falta. Con
+// mensajes chicos la ventana de congestión (en bytes) permite muchos más, así que además
+// no se manda nada más allá de acked + SUB_WINDOW.
+static int sub_flow_ok(const sub_ack_t *ak) {
+    return ak->sent_hi < ak->acked + SUB_WINDOW;
+}
+
+// Siguiente mensaje que la suscripción i puede mandar ahora; NULL si no hay o no hay ventana.
+static const msg_index_t *sub_next(client_t *cl, size_t i, int *rtx) {
+    sub_ack_t *ak = &cl->ack[i];
+    stream_state_t *st = cl->subs[i];
+
+    // 1) Retransmisiones pedidas por NACK (sin lo ya confirmado ni lo que salió del historial)
+    while (ak->rtx_from && ak->rtx_from <= ak->rtx_to) {
+        uint64_t s = ak->rtx_from++;
+        if (s > ak->base && (s <= ak->acked || sack_covers(ak, s))) continue;
+        const msg_index_t *e = stream_find(st, s);
+        if (!e && s >= st->lo_seq && s <= st->hi_seq) {
+            // Compactado: se vuelve a mandar el rango (hasta lo pedido)
+            e = stream_gap(st, s, ak->rtx_to);
+            ak->rtx_from = e->seq + 1;
+        }
+        if (e) {
+            *rtx = 1;
+            return e;
+        }
+    }
+    ak->rtx_from = ak->rtx_to = 0;
+
+    // 2) Mensajes nuevos, si la ventana de congestión y la del suscriptor lo permiten
+    if (ak->sent_hi >= st->hi_seq || cl->in_flight >= cl->cwnd || !sub_flow_ok(ak)) return NULL;
+    if (ak->sent_hi + 1 < st->lo_seq) {
+        // Se quedó tan atrás que lo pendiente ya salió del historial: se da por perdido
+        ak->sent_hi = ak->acked = st->lo_seq - 1;
+        ak->timed_seq = 0;
+        client_recount(cl);
+    }
+    const msg_index_t *e = stream_find(st, ak->sent_hi + 1);
+    // Un hueco por compactación sale como un F_GAP, sin pasarse de la ventana del suscriptor
+    if (!e) e = stream_gap(st, ak->sent_hi + 1, ak->acked + SUB_WINDOW);
+    *rtx = 0;
+    return e;
+}
+
+static int client_sendable(client_t *cl) {
+    for (size_t i = 0; i < cl->n_streams; ++i) {
+        const sub_ack_t *ak = &cl->ack[i];
+        if (ak->rtx_from) return 1;
+        if (ak->sent_hi < cl->subs[i]->hi_seq && cl->in_flight < cl->cwnd && sub_flow_ok(ak))
+            return 1;
+    }
+    return 0;
+}
+
+// Manda lo que la ventana y el pacer permitan, repartiendo entre suscripciones. Si queda
+// algo frenado sólo por el pacer, se arma su temporizador; si lo frena la ventana, el
+// próximo ACK vuelve a llamar acá.
+static void client_pump(int sock, client_t *cl) {
+    if (cl->n_streams == 0) return;
+    pacer_refill(cl);
+    for (int sent = 1; sent && cl->tokens > 0; ) {
+        sent = 0;
+        for (size_t k = 0; k < cl->n_streams && cl->tokens > 0; ++k) {
+            size_t i = (cl->rr + k) % cl->n_streams;
+            int rtx = 0;
+            const msg_index_t *e = sub_next(cl, i, &rtx);
+            if (!e) continue;
+            send_from_history(sock, cl, (int)i, cl->subs[i], e, rtx);
+            cl->tokens -= msg_wire(e->len);
+            sent = 1;
+        }
+        cl->rr++;
+    }
+    if (cl->tokens <= 0 && client_sendable(cl)) {
+        uint64_t wait = (uint64_t)(-cl->tokens / pacing_rate(cl)) + 1;
+        if (cl->pacer.heap_pos < 0 || cl->pacer.when > loop_now + wait)
+            timer_arm(&cl->pacer, loop_now + wait);
+    }
+}
+
+static void client_pacer_fire(int sock, qtimer_t *t) {
+    client_pump(sock, (client_t *)((char *)t - offsetof(client_t, pacer)));
+}
+
+// ACK del suscriptor: "ACK:<acumulado>[;a-b]..." con rangos recibidos por encima (SACK)
+static void handle_ack(int sock, client_t *cl, stream_state_t *st, const char *payload) {
+    int slot = client_sub_slot(cl, st);
+    if (slot < 0) return;
+    sub_ack_t *ak = &cl->ack[slot];
+    uint64_t before = sub_in_flight(st, ak);
+
+    unsigned long long cum;
+    int off = 0;
+    if (sscanf(payload, "ACK:%llu%n", &cum, &off) != 1) return;
+    uint64_t largest = cum;
+    ak->n_sack = 0;
+    const char *p = payload + off;
+    unsigned long long a, b;
+    int n;
+    while (ak->n_sack < ACK_MAX_RANGES && sscanf(p, ";%llu-%llu%n", &a, &b, &n) == 2) {
+        if (a <= b && b <= ak->sent_hi) {
+            ak->sack[ak->n_sack][0] = a;
+            ak->sack[ak->n_sack][1] = b;
+            ak->n_sack++;
+            if (b > largest) largest = b;
+        }
+        p += n;
+    }
+    if (largest > ak->sent_hi) largest = ak->sent_hi;
+
+    int progress = 0;
+    if (cum > ak->sent_hi) cum = ak->sent_hi;
+    if (cum > ak->acked) {
+        ak->acked = cum;
+        progress = 1;
+    }
+    // Un rango SACK pegado al acumulado también lo hace avanzar
+    for (int again = 1; again; ) {
+        again = 0;
+        for (int i = 0; i < ak->n_sack; ++i) {
+            if (ak->sack[i][0] <= ak->acked + 1 && ak->sack[i][1] > ak->acked) {
+                ak->acked = ak->sack[i][1];
+                again = progress = 1;
+            }
+        }
+    }
+
+    if (largest > ak->largest_acked) {
+        ak->largest_acked = largest;
+        progress = 1;
+    }
+    // Muestra de RTT cuando llega la seq cronometrada, salvo que se haya retransmitido
+    // (sería ambigua). Se toma la hora de envío real: con pacing un mensaje puede esperar
+    // en el historial antes de salir.
+    if (ak->timed_seq && (ak->timed_seq <= ak->acked || sack_covers(ak, ak->timed_seq))) {
+        if (ak->timed_seq > ak->rtx_hi) rtt_sample(cl, loop_now - ak->timed_ms);
+        ak->timed_seq = 0;
+    }
+    if (progress) {
+        // Con progreso se reinicia el backoff y el PTO se recalcula con el RTT nuevo
+        cl->pto_count = 0;
+        if (cl->pto.heap_pos >= 0) timer_arm(&cl->pto, cl->last_send + client_pto_ms(cl));
+    }
 
-    st->head = (st->head + 1) % HISTORY_DEPTH;
-    if (st->size < HISTORY_DEPTH) st->size++;
+    // Lo confirmado libera ventana (y la agranda); puede salir lo que estaba esperando
+    uint64_t after = sub_in_flight(st, ak);
+    client_recount(cl);
+    cwnd_on_ack(cl, before > after ? (uint32_t)((before - after) * st->avg_wire) : 0);
+    client_pump(sock, cl);
 }
 
-// Reenviar rango [from,to] a un cliente si está en buffer
+// PTO: pasó un RTT (más margen) sin que se confirme lo último enviado. Se reenvían los
+// primeros mensajes en vuelo, así una pérdida en la cola no espera al próximo publish.
+static void client_pto_fire(int sock, qtimer_t *t) {
+    client_t *cl = (client_t *)((char *)t - offsetof(client_t, pto));
+    int in_flight = 0;
+    for (size_t i = 0; i < cl->n_streams; ++i)
+        if (cl->ack[i].acked < cl->ack[i].sent_hi) in_flight = 1;
+    if (!in_flight) return;   // todo confirmado: queda desarmado
+
+    uint64_t deadline = cl->last_send + client_pto_ms(cl);
+    if (deadline > loop_now) {
+        timer_arm(t, deadline);
+        return;
+    }
+
+    for (size_t i = 0; i < cl->n_streams; ++i) {
+        sub_ack_t *ak = &cl->ack[i];
+        stream_state_t *st = cl->subs[i];
+        // Lo que ya salió del historial no se puede reenviar: se da por perdido
+        if (ak->acked + 1 < st->lo_seq) ak->acked = st->lo_seq - 1;
+        if (ak->timed_seq <= ak->acked) ak->timed_seq = 0;
+        int sent = 0;
+        for (uint64_t s = ak->acked + 1; s <= ak->sent_hi && sent < PTO_BURST; ++s) {
+            if (sack_covers(ak, s)) continue;
+            const msg_index_t *e = stream_find(st, s);
+            if (!e) continue;
+            send_from_history(sock, cl, (int)i, st, e, 1);
+            sent++;
+        }
+    }
+    client_recount(cl);
+    if (cl->pto_count < PTO_MAX_BACKOFF) cl->pto_count++;
+    if (cl->pto_count == PTO_PERSISTENT) {
+        // Sin respuesta durante varios PTO: congestión persistente
+        cl->ssthresh = cl->cwnd / 2 < CWND_MIN ? CWND_MIN : cl->cwnd / 2;
+        cl->cwnd = CWND_MIN;
+        cl->ca_acc = 0;
+    }
+    cl->last_send = loop_now;
+    timer_arm(t, loop_now + client_pto_ms(cl));
+}
+
+// NACK: reenviar rango [from,to] a un cliente si está en buffer. No sale todo de golpe:
+// queda pendiente en la suscripción y el pacer lo va mandando.
 static void resend_range(int sock, client_t *cl, stream_state_t *st,
                          uint64_t from_seq, uint64_t to_seq)
 {
     if (!st || !cl) return;
-    // Buscar mínimos y máximos en buffer
-    if (st->size == 0) return;
-    // Reconstruir ventana de historial
-    // El más antiguo está en (head - size + HISTORY_DEPTH) % HISTORY_DEPTH
-    size_t oldest = (st->head + HISTORY_DEPTH - st->size) % HISTORY_DEPTH;
-    uint64_t min_seq = st->history[oldest].seq;
-    uint64_t max_seq = st->history[(st->head + HISTORY_DEPTH - 1) % HISTORY_DEPTH].seq;
-
-    if (to_seq < min_seq || from_seq > max_seq) {
-        // Fuera de ventana; no podemos reenviar
-        return;
+    if (st->hi_seq == 0) return;
+    int slot = client_sub_slot(cl, st);
+    if (slot < 0) return;
+    sub_ack_t *ak = &cl->ack[slot];
+
+    // Sólo lo que ya se le mandó (o el backlog anterior a su suscripción) y sigue guardado
+    if (from_seq < st->lo_seq) from_seq = st->lo_seq;
+    if (to_seq > ak->sent_hi) to_seq = ak->sent_hi;
+    if (from_seq > to_seq) return;
+
+    if (ak->rtx_from) {
+        if (from_seq > ak->rtx_from) from_seq = ak->rtx_from;
+        if (to_seq < ak->rtx_to) to_seq = ak->rtx_to;
     }
+    ak->rtx_from = from_seq;
+    ak->rtx_to = to_seq;
 
-    if (from_seq < min_seq) from_seq = min_seq;
-    if (to_seq > max_seq) to_seq = max_seq;
-
-    for (uint64_t s = from_seq; s <= to_seq; ++s) {
-        // Buscar secuencia s en el buffer linealmente (HISTORY_DEPTH acotado)
-        for (size_t i = 0; i < st->size; ++i) {
-            size_t idx = (oldest + i) % HISTORY_DEPTH;
-            if (st->history[idx].seq == s) {
-                (void)send_pkt(sock, &cl->addr, PKT_DATA,
-                               st->history[idx].flags,
-                               st->history[idx].stream_id,
-                               st->history[idx].seq,
-                               st->history[idx].data,
-                               st->history[idx].len,
-                               BROKER_KEY, 1);
-                break;
-            }
-        }
+    // Un hueco en lo enviado en vivo es pérdida; pedir el backlog al suscribirse no
+    if (to_seq > ak->base) congestion_event(cl);
+    client_pump(sock, cl);
+}
+
+// Guarda (o borra, si viene vacío) el valor retenido del stream. Un fragmento no puede
+// serlo: el suscriptor nuevo no tendría el resto del mensaje.
+static void stream_retain(stream_state_t *st, uint64_t seq, const char *msg, uint16_t len) {
+    if (len == 0) {
+        free(st->retained);
+        st->retained = NULL;
+        st->retained_seq = 0;
+        st->retained_len = 0;
+        return;
     }
+    char *p = realloc(st->retained, len);
+    if (!p) return;
+    memcpy(p, msg, len);
+    xor_cipher(p, len, BROKER_KEY);
+    st->retained = p;
+    st->retained_len = len;
+    st->retained_seq = seq;
 }
 
 // Publicar a todos los clientes suscritos a stream_id
@@ -302,22 +1454,193 @@ static void publish_to_subscribers(int sock, uint32_t stream_id,
     uint64_t seq = st->next_seq++;
     // Guardar en buffer para posibles retransmisiones
     stream_store(st, seq, msg, len, flags);
+    const msg_index_t *e = stream_find(st, seq);
+    if ((flags & F_RETAIN) && !(flags & F_FRAG)) stream_retain(st, seq, msg, len);
+
+    // El paquete es idéntico para todos (misma clave y seq): se arma una vez copiando el
+    // payload ya cifrado del historial y cada suscriptor es sólo una entrada más del
+    // vector de sendmmsg().
+    // Si el suscriptor está al día y su ventana y su pacer lo permiten, sale el paquete
+    // compartido; si no, el mensaje queda en el historial y lo manda su pacer después.
+    char *pkt = NULL;
+    int plen = -1;
+    for (int i = 0; i < st->n_subs; ++i) {
+        client_t *cl = &clients[st->subs[i].client];
+        sub_ack_t *ak = &cl->ack[st->subs[i].slot];
+        pacer_refill(cl);
+        if (ak->sent_hi + 1 != seq || ak->rtx_from || cl->in_flight >= cl->cwnd ||
+            !sub_flow_ok(ak) || cl->tokens <= 0) {
+            client_pump(sock, cl);
+            continue;
+        }
+        if (!pkt) {
+            pkt = tx_alloc(sock);
+            plen = e ? build_pkt(pkt, PKT_DATA, flags, stream_id, seq, stream_data(st, e), len, BROKER_KEY, 0)
+                     : build_pkt(pkt, PKT_DATA, flags, stream_id, seq, msg, len, BROKER_KEY, 1);
+            if (plen < 0) return;
+        }
+        tx_to_client(sock, cl, pkt, (size_t)plen);
+        sub_sent_new(cl, ak, seq, len);
+        cl->tokens -= msg_wire(len);
+        client_data_sent(cl);
+    }
+}
 
-    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
-        if (!clients[i].active) continue;
-        if (!client_is_subscribed(&clients[i], stream_id)) continue;
-        (void)send_pkt(sock, &clients[i].addr, PKT_DATA, flags, stream_id,
-                       seq, msg, len, BROKER_KEY, 1);
+// Procesa un paquete ya decodificado (payload descifrado si correspondía)
+static void handle_packet(int sockfd, const struct sockaddr_in *src,
+                          const quic_like_header_t *h, char *payload, int r)
+{
+    struct sockaddr_in from = *src;
+    quic_like_header_t hdr = *h;
+    client_t *cl = get_client(&from);
+    if (cl) cl->last_seen = loop_now;
+
+    switch (hdr.type) {
+        case PKT_HELLO: {
+            const char reply[16];
+            // Enviar PKT_HELLO_REPLY en claro con KEY:n
+            // No ciframos el payload del HELLO_REPLY:
+            char msg[32];
+            snprintf(msg, sizeof(msg), "KEY:%d", BROKER_KEY);
+            (void)send_pkt(sockfd, &from, PKT_HELLO_REPLY, 0, 0, 0,
+                           msg, (uint32_t)strlen(msg), 0, 0);
+            break;
+        }
+
+        case PKT_SUBSCRIBE: {
+            // payload: "SUB:<stream_id>[:<desde>]" (desde = earliest | latest | <seq> | @<ms>)
+            payload[r] = '\0';
+            if (strncmp(payload, "SUB:", 4) == 0) {
+                char *end;
+                uint32_t sid = (uint32_t)strtoul(payload + 4, &end, 10);
+                const char *start_at = *end == ':' ? end + 1 : NULL;
+                uint64_t start = 0;
+                if (client_subscribe(cl, sid, start_at, &start) == 0) {
+                    // "SUB_OK:<seq>": primera seq que va a recibir (también en el encabezado)
+                    char ok[40];
+                    int n = snprintf(ok, sizeof(ok), "SUB_OK:%llu", (unsigned long long)start);
+                    (void)send_pkt(sockfd, &from, PKT_ACK, 0, sid, start,
+                                   ok, (uint32_t)n, BROKER_KEY, 1);
+                    // Valor retenido anterior al punto de partida: va una vez, con su seq
+                    // original, fuera de la secuencia confirmada de la suscripción
+                    const stream_state_t *st = get_stream(sid);
+                    if (st && st->retained_seq && st->retained_seq < start)
+                        (void)send_pkt(sockfd, &from, PKT_DATA, F_RETAIN, sid, st->retained_seq,
+                                       st->retained, st->retained_len, BROKER_KEY, 0);
+                    fprintf(stderr, "Cliente suscrito a stream_id=%u desde seq=%llu\n",
+                            sid, (unsigned long long)start);
+                }
+            }
+            break;
+        }
+
+        case PKT_ACK: {
+            // payload: "ACK:<acumulado>[;a-b]..." para hdr.stream_id
+            payload[r] = '\0';
+            if (!cl) break;
+            stream_state_t *st = get_stream(hdr.stream_id);
+            if (st) handle_ack(sockfd, cl, st, payload);
+            break;
+        }
+
+        case PKT_NACK: {
+            // payload: "NACK:<from>-<to>"
+            payload[r] = '\0';
+            uint64_t a = 0, b = 0;
+            if (sscanf(payload, "NACK:%llu-%llu",
+                       (unsigned long long*)&a,
+                       (unsigned long long*)&b) == 2) {
+                // Reenviar rango al cliente para hdr.stream_id
+                stream_state_t *st = get_stream(hdr.stream_id);
+                resend_range(sockfd, cl, st, a, b);
+            }
+            break;
+        }
+
+        case PKT_PING: {
+            const char pong[] = "PONG";
+            (void)send_pkt(sockfd, &from, PKT_PONG, 0, 0, 0,
+                           pong, (uint32_t)strlen(pong), BROKER_KEY, 1);
+            break;
+        }
+
+        case PKT_PONG:
+            // No se espera desde el suscriptor
+            break;
+
+        case PKT_DATA: {
+            // Tratar DATA entrante como publicación en stream hdr.stream_id
+            // Guardar y reenviar a suscriptores (como publish_to_subscribers)
+            stream_state_t *st = get_stream(hdr.stream_id);
+            if (!st) break;
+            // Si viene cifrado ya lo desciframos arriba
+
+            uint8_t flags = hdr.flags;
+            uint16_t len  = (uint16_t)hdr.length;
+            // Guardar con la secuencia "propia" del broker (continuidad para sus clientes)
+            // Opción A (simple): el broker asigna su propia seq:
+            publish_to_subscribers(sockfd, hdr.stream_id, payload, len, flags);
+
+            // (Opcional Opción B: respetar hdr.seq del publisher y guardarlo manualmente)
+            break;
+        }
+
+
+        default:
+            break;
+    }
+}
+
+// PKT_FRAMES: cada frame se atiende como si hubiera llegado en su propio paquete.
+static void handle_frames(int sockfd, const struct sockaddr_in *src, const char *p, int r) {
+    size_t off = 0;
+    while (off + sizeof(quic_like_frame_t) <= (size_t)r) {
+        quic_like_frame_t f;
+        memcpy(&f, p + off, sizeof(f));
+        off += sizeof(f);
+        size_t len = ntohs(f.length);
+        if (len > (size_t)r - off) break;   // frame truncado: se descarta el resto
+        if (f.type != PKT_HELLO && f.type != PKT_FRAMES) {
+            quic_like_header_t hdr;
+            hdr.magic = MAGIC;
+            hdr.version = PROTO_VERSION;
+            hdr.type = f.type;
+            hdr.flags = f.flags;
+            hdr.reserved = 0;
+            hdr.stream_id = ntohl(f.stream_id);
+            hdr.seq = be64toh(f.seq);
+            hdr.length = (uint32_t)len;
+            char payload[MAX_PAYLOAD + 1];
+            memcpy(payload, p + off, len);
+            handle_packet(sockfd, src, &hdr, payload, (int)len);
+        }
+        off += len;
     }
 }
 
 // ====== Broker main ======
-int main(void)
+int main(int argc, char **argv)
 {
     int sockfd;
     struct sockaddr_in srv;
 
-    memset(clients, 0, sizeof(clients));
+    // --history=N mensajes y --history-bytes=N bytes de historial por stream, --compact
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--history=", 10) == 0) {
+            hist_count = strtoul(argv[i] + 10, NULL, 10);
+        } else if (strncmp(argv[i], "--history-bytes=", 16) == 0) {
+            hist_bytes = strtoul(argv[i] + 16, NULL, 10);
+        } else if (strcmp(argv[i], "--compact") == 0) {
+            compact_mode = 1;   // los mensajes con F_KEYED reemplazan al anterior de su clave
+        } else {
+            fprintf(stderr, "Uso: %s [--history=N] [--history-bytes=N] [--compact]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (hist_count < 1) hist_count = 1;
+    if (hist_bytes < MAX_PAYLOAD) hist_bytes = MAX_PAYLOAD;   // cualquier mensaje debe caber
+
+    clients_init();
     memset(streams, 0, sizeof(streams));
     n_streams = 0;
 
@@ -332,6 +1655,10 @@ int main(void)
         perror("setsockopt SO_REUSEADDR");
     }
 
+    // Entran publicaciones y además los ACK de cada suscriptor: buffer de recepción amplio
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
     memset(&srv, 0, sizeof(srv));
     srv.sin_family = AF_INET;
     srv.sin_port = htons(PORT);
@@ -351,130 +1678,79 @@ int main(void)
     printf("Formato de publicación por stdin:  topic|mensaje\n");
     printf("Ejemplo:  EquipoAvsB|Gol minuto 45\n");
 
+    // Buffers de recepción por tandas (recvmmsg)
+    static char               rx_buf[RX_BATCH][BUFFER_SIZE];
+    static struct sockaddr_in rx_from[RX_BATCH];
+    static struct iovec       rx_iov[RX_BATCH];
+    static struct mmsghdr     rx_msgs[RX_BATCH];
+
     fd_set rfds;
+    int stdin_open = 1;
+    loop_now = now_ms();
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    wall_offset = (uint64_t)rt.tv_sec * 1000u + (uint64_t)rt.tv_nsec / 1000000u - loop_now;
     for (;;) {
         FD_ZERO(&rfds);
         FD_SET(sockfd, &rfds);
-        FD_SET(STDIN_FILENO, &rfds);
+        if (stdin_open) FD_SET(STDIN_FILENO, &rfds);
         int maxfd = (sockfd > STDIN_FILENO ? sockfd : STDIN_FILENO);
 
-        struct timeval tv = { RECV_TIMEOUT_SEC, 0 };
-        int rv = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+        // Se duerme hasta el próximo deadline (o indefinidamente si no hay temporizadores)
+        int64_t wait = timer_next_ms();
+        struct timeval tv = { (time_t)(wait / 1000), (suseconds_t)(wait % 1000) * 1000 };
+        int rv = select(maxfd + 1, &rfds, NULL, NULL, wait < 0 ? NULL : &tv);
+        loop_now = now_ms();
         if (rv < 0) {
             if (errno == EINTR) continue;
             perror("select");
             break;
         }
 
-        // Entrada de red
+        // Entrada de red: se drenan los datagramas en tandas de RX_BATCH con recvmmsg()
         if (FD_ISSET(sockfd, &rfds)) {
-            struct sockaddr_in from;
-            quic_like_header_t hdr;
-            char payload[MAX_PAYLOAD];
-
-            // Intentamos recibir sin desencriptar primero para ver el tipo:
-            int r = recv_pkt(sockfd, &from, &hdr, payload, sizeof(payload), 0, 0);
-            if (r >= 0) {
-                // Si es SUBSCRIBE/ACK/NACK/PKT_PING, el payload venía cifrado
-                // Después: incluye PKT_DATA
-            int needs_decrypt = (hdr.type == PKT_SUBSCRIBE ||
-                                hdr.type == PKT_ACK ||
-                                hdr.type == PKT_NACK ||
-                                hdr.type == PKT_PING ||
-                                hdr.type == PKT_DATA);
-            if (needs_decrypt) xor_cipher(payload, hdr.length, BROKER_KEY);
-
-                client_t *cl = get_client(&from);
-                if (cl) cl->last_seen = time(NULL);
-
-                switch (hdr.type) {
-                    case PKT_HELLO: {
-                        const char reply[16];
-                        // Enviar PKT_HELLO_REPLY en claro con KEY:n
-                        // No ciframos el payload del HELLO_REPLY:
-                        char msg[32];
-                        snprintf(msg, sizeof(msg), "KEY:%d", BROKER_KEY);
-                        (void)send_pkt(sockfd, &from, PKT_HELLO_REPLY, 0, 0, 0,
-                                       msg, (uint32_t)strlen(msg), 0, 0);
-                        break;
-                    }
-
-                    case PKT_SUBSCRIBE: {
-                        // payload: "SUB:<stream_id>"
-                        payload[r] = '\0';
-                        if (strncmp(payload, "SUB:", 4) == 0) {
-                            uint32_t sid = (uint32_t)strtoul(payload + 4, NULL, 10);
-                            (void)get_stream(sid);
-                            if (client_subscribe(cl, sid) == 0) {
-                                // ACK opcional de suscripción
-                                const char ok[] = "SUB_OK";
-                                (void)send_pkt(sockfd, &from, PKT_ACK, 0, sid, 0,
-                                               ok, (uint32_t)strlen(ok), BROKER_KEY, 1);
-                                fprintf(stderr, "Cliente suscrito a stream_id=%u\n", sid);
-                            }
-                        }
-                        break;
-                    }
-
-                    case PKT_ACK: {
-                        // payload: "ACK:<seq>"
-                        // Podemos registrar stats o ignorar
-                        break;
-                    }
-
-                    case PKT_NACK: {
-                        // payload: "NACK:<from>-<to>"
-                        payload[r] = '\0';
-                        uint64_t a = 0, b = 0;
-                        if (sscanf(payload, "NACK:%llu-%llu",
-                                   (unsigned long long*)&a,
-                                   (unsigned long long*)&b) == 2) {
-                            // Reenviar rango al cliente para hdr.stream_id
-                            stream_state_t *st = get_stream(hdr.stream_id);
-                            resend_range(sockfd, cl, st, a, b);
-                        }
-                        break;
-                    }
-
-                    case PKT_PING: {
-                        const char pong[] = "PONG";
-                        (void)send_pkt(sockfd, &from, PKT_PONG, 0, 0, 0,
-                                       pong, (uint32_t)strlen(pong), BROKER_KEY, 1);
-                        break;
-                    }
-
-                    case PKT_PONG:
-                        // No se espera desde el suscriptor
-                        break;
-
-                    case PKT_DATA: {
-                        // Tratar DATA entrante como publicación en stream hdr.stream_id
-                        // Guardar y reenviar a suscriptores (como publish_to_subscribers)
-                        stream_state_t *st = get_stream(hdr.stream_id);
-                        if (!st) break;
-                        // Si viene cifrado ya lo desciframos arriba
-
-                        uint8_t flags = hdr.flags;
-                        uint16_t len  = (uint16_t)hdr.length;
-                        // Guardar con la secuencia "propia" del broker (continuidad para sus clientes)
-                        // Opción A (simple): el broker asigna su propia seq:
-                        publish_to_subscribers(sockfd, hdr.stream_id, payload, len, flags);
-
-                        // (Opcional Opción B: respetar hdr.seq del publisher y guardarlo manualmente)
-                        break;
-                    }
-
-
-                    default:
-                        break;
+            int n;
+            do {
+                for (int i = 0; i < RX_BATCH; ++i) {
+                    rx_iov[i].iov_base = rx_buf[i];
+                    rx_iov[i].iov_len = BUFFER_SIZE;
+                    memset(&rx_msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+                    rx_msgs[i].msg_hdr.msg_name = &rx_from[i];
+                    rx_msgs[i].msg_hdr.msg_namelen = sizeof(rx_from[i]);
+                    rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+                    rx_msgs[i].msg_hdr.msg_iovlen = 1;
                 }
-            }
+                n = recvmmsg(sockfd, rx_msgs, RX_BATCH, MSG_DONTWAIT, NULL);
+                for (int i = 0; i < n; ++i) {
+                    quic_like_header_t hdr;
+                    char payload[MAX_PAYLOAD + 1];
+
+                    // Se decodifica sin desencriptar primero para ver el tipo:
+                    int r = parse_pkt(rx_buf[i], (ssize_t)rx_msgs[i].msg_len, &hdr,
+                                      payload, MAX_PAYLOAD, 0, 0);
+                    if (r < 0) continue;
+                    // Si es SUBSCRIBE/ACK/NACK/PKT_PING, el payload venía cifrado
+                    // Después: incluye PKT_DATA
+                    int needs_decrypt = (hdr.type == PKT_SUBSCRIBE ||
+                                         hdr.type == PKT_ACK ||
+                                         hdr.type == PKT_NACK ||
+                                         hdr.type == PKT_PING ||
+                                         hdr.type == PKT_DATA ||
+                                         hdr.type == PKT_FRAMES);
+                    if (needs_decrypt) xor_cipher(payload, hdr.length, BROKER_KEY);
+                    if (hdr.type == PKT_FRAMES)
+                        handle_frames(sockfd, &rx_from[i], payload, r);
+                    else
+                        handle_packet(sockfd, &rx_from[i], &hdr, payload, r);
+                }
+            } while (n == RX_BATCH);
         }
 
         // Entrada por stdin (publicación)
-        if (FD_ISSET(STDIN_FILENO, &rfds)) {
+        if (stdin_open && FD_ISSET(STDIN_FILENO, &rfds)) {
             char line[2048];
             ssize_t n = read(STDIN_FILENO, line, sizeof(line) - 1);
+            if (n == 0) stdin_open = 0;   // EOF: se sigue sólo con la red
             if (n > 0) {
                 line[n] = '\0';
                 // Quitar \n finales
@@ -483,11 +1759,11 @@ int main(void)
                     line[n-1] = '\0';
                     n--;
                 }
-                if (n == 0) continue;
-
                 // Formato: topic|mensaje
                 char *bar = strchr(line, '|');
-                if (!bar) {
+                if (n == 0) {
+                    // línea vacía: nada que publicar
+                } else if (!bar) {
                     // Si no hay '|', tomamos un topic por defecto "default"
                     const char *topic = "default";
                     uint32_t sid = djb2_hash(topic);
@@ -504,8 +1780,11 @@ int main(void)
             }
         }
 
-        // Mantenimiento
-        purge_inactive_clients();
+        // Expiraciones y keepalives vencidos
+        timers_run(sockfd);
+
+        // Todo el fan-out, las retransmisiones y los PING de esta vuelta salen juntos
+        tx_end(sockfd);
     }
 
     close(sockfd);
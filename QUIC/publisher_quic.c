@@ -11,6 +11,9 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>   // XOR de a 16/32 bytes
+#endif
 
 #define BUFFER_SIZE 1500
 #define PORT 5928
@@ -21,6 +24,7 @@
 #define MAX_PAYLOAD (BUFFER_SIZE - 64)
 #define RECV_TIMEOUT_SEC 3
 #define KEEPALIVE_SEC 10
+#define MAX_MESSAGE (64 * 1024)   // mensaje más grande que se acepta (se manda en fragmentos)
 
 typedef enum {
     PKT_HELLO = 1,
@@ -33,6 +37,10 @@ typedef enum {
     PKT_PONG = 8
 } pkt_type_t;
 
+#define F_FRAG 0x02   // DATA con un fragmento de un mensaje más grande que MAX_PAYLOAD
+#define F_RETAIN 0x04 // el broker guarda el mensaje como valor retenido del tópico
+#define F_KEYED 0x08  // la clave es el principio del mensaje hasta el primer ':' ("score:")
+
 #pragma pack(push, 1)
 typedef struct {
     uint32_t magic;
@@ -44,8 +52,17 @@ typedef struct {
     uint64_t seq;
     uint32_t length;
 } quic_like_header_t;
+
+// Encabezado de un fragmento, al principio del payload de un DATA con F_FRAG
+typedef struct {
+    uint64_t msg_id;     // igual en todos los fragmentos del mensaje
+    uint32_t total;      // largo del mensaje completo
+    uint32_t offset;     // posición de este fragmento (múltiplo de FRAG_DATA)
+} quic_like_frag_t;
 #pragma pack(pop)
 
+#define FRAG_DATA (MAX_PAYLOAD - sizeof(quic_like_frag_t))   // bytes de mensaje por fragmento
+
 static uint32_t djb2_hash(const char *s) {
     uint32_t h = 5381u;
     int c;
@@ -55,8 +72,58 @@ static uint32_t djb2_hash(const char *s) {
     return h;
 }
 
+// XOR con la clave repetida en cada byte. Se recorre de a 32, 16 u 8 bytes según lo que
+// soporte la CPU (se elige una vez, en la primera llamada) y el resto byte a byte.
+static size_t xor_words(char *data, size_t len, unsigned char key) {
+    uint64_t k = 0x0101010101010101ull * key;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        w ^= k;
+        memcpy(data + i, &w, 8);
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t xor_avx2(char *data, size_t len, unsigned char key) {
+    __m256i k = _mm256_set1_epi8((char)key);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(v, k));
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static size_t xor_sse2(char *data, size_t len, unsigned char key) {
+    __m128i k = _mm_set1_epi8((char)key);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, k));
+    }
+    return i;
+}
+#endif
+
+static size_t (*xor_wide)(char *, size_t, unsigned char);
+
 void xor_cipher(char *data, size_t len, unsigned char key) {
-    for (size_t i = 0; i < len; i++) data[i] ^= key;
+    if (!xor_wide) {
+        xor_wide = xor_words;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) xor_wide = xor_avx2;
+        else if (__builtin_cpu_supports("sse2")) xor_wide = xor_sse2;
+#endif
+    }
+    size_t i = xor_wide(data, len, key);
+    i += xor_words(data + i, len - i, key);
+    for (; i < len; i++) data[i] ^= key;
 }
 
 static int send_pkt(int sock, const struct sockaddr_in *addr,
@@ -118,6 +185,34 @@ static int recv_pkt(int sock, struct sockaddr_in *from, quic_like_header_t *out_
     return (int)length;
 }
 
+// Publica un mensaje: si entra en un paquete sale como DATA común; si no, en fragmentos
+// de FRAG_DATA bytes, cada uno en su propio datagrama (sin fragmentación IP). El broker
+// les da seq propias, así que se confirman y se reenvían de a un fragmento.
+// flags (F_RETAIN, F_KEYED) sólo vale para un mensaje que entra en un paquete.
+static int publish_msg(int sock, const struct sockaddr_in *srv, uint32_t stream_id,
+                       uint64_t *seq, uint64_t msg_id, const char *msg, size_t len,
+                       uint8_t flags, unsigned char key)
+{
+    if (len <= MAX_PAYLOAD)
+        return send_pkt(sock, srv, PKT_DATA, flags, stream_id, (*seq)++, msg, (uint32_t)len, key, 1);
+    if (len > MAX_MESSAGE) return -1;
+
+    char frag[MAX_PAYLOAD];
+    quic_like_frag_t fh;
+    fh.msg_id = htobe64(msg_id);
+    fh.total = htonl((uint32_t)len);
+    for (size_t off = 0; off < len; off += FRAG_DATA) {
+        size_t n = len - off < FRAG_DATA ? len - off : FRAG_DATA;
+        fh.offset = htonl((uint32_t)off);
+        memcpy(frag, &fh, sizeof(fh));
+        memcpy(frag + sizeof(fh), msg + off, n);
+        if (send_pkt(sock, srv, PKT_DATA, F_FRAG, stream_id, (*seq)++,
+                     frag, (uint32_t)(sizeof(fh) + n), key, 1) != 0)
+            return -1;
+    }
+    return 0;
+}
+
 // === Handshake ===
 static int do_handshake_get_key(int sock, const struct sockaddr_in *srv, unsigned char *out_key)
 {
@@ -144,6 +239,15 @@ int main(int argc, char **argv)
 {
     const char *broker_ip = IP_BROKER;
     int broker_port = PORT;
+    // --retain: cada mensaje queda como valor retenido del tópico (vacío = borrarlo)
+    // --keyed: los mensajes llevan clave; un broker con --compact guarda el último de cada una
+    uint8_t pub_flags = 0;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--retain") == 0) pub_flags |= F_RETAIN;
+        else if (strcmp(argv[1], "--keyed") == 0) pub_flags |= F_KEYED;
+        argc--;
+        argv++;
+    }
 
     if (argc == 3) {
         broker_ip = argv[1];
@@ -182,18 +286,30 @@ int main(int argc, char **argv)
     uint32_t stream_id = djb2_hash(topic);
 
     uint64_t seq = 1;
-    char msg[512];
+    // msg_id de los fragmentos: los 32 bits altos distinguen a este publicador de otros del mismo tópico
+    uint64_t msg_id = (uint64_t)(uint32_t)(time(NULL) ^ ((unsigned)getpid() << 16)) << 32;
+    char *msg = NULL;
+    size_t msg_cap = 0;
+    ssize_t n;
     while (1) {
         printf("Mensaje a publicar (o SALIR): ");
-        if (!fgets(msg, sizeof(msg), stdin)) break;
-        msg[strcspn(msg, "\n")] = 0;
+        if ((n = getline(&msg, &msg_cap, stdin)) < 0) break;
+        if (n > 0 && msg[n - 1] == '\n') msg[--n] = 0;
         if (strcmp(msg, "SALIR") == 0) break;
 
-        if (send_pkt(sockfd, &server_addr, PKT_DATA, 0, stream_id, seq, msg, strlen(msg), broker_key, 1) == 0)
-            printf("Enviado seq=%llu\n", (unsigned long long)seq);
-        seq++;
+        uint64_t first = seq;
+        if (publish_msg(sockfd, &server_addr, stream_id, &seq, ++msg_id, msg, (size_t)n,
+                        pub_flags, broker_key) == 0) {
+            if (seq - first == 1) printf("Enviado seq=%llu\n", (unsigned long long)first);
+            else printf("Enviado seq=%llu-%llu (%zd bytes en %llu fragmentos)\n",
+                        (unsigned long long)first, (unsigned long long)(seq - 1), n,
+                        (unsigned long long)(seq - first));
+        } else if ((size_t)n > MAX_MESSAGE) {
+            fprintf(stderr, "Mensaje demasiado grande (máximo %d bytes)\n", MAX_MESSAGE);
+        }
     }
 
+    free(msg);
     close(sockfd);
     return 0;
 }
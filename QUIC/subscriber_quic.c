@@ -6,7 +6,12 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
+#include <poll.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>   // XOR de a 16/32 bytes
+#endif
 
 #define BUFFER_SIZE 1500
 #define PORT 5928
@@ -16,6 +21,15 @@
 #define MAGIC 0x51554331u
 #define MAX_PAYLOAD (BUFFER_SIZE - 64)
 #define RECV_TIMEOUT_SEC 5
+#define REORDER_WINDOW 512   // mensajes guardados por encima del acumulado (múltiplo de 8)
+#define ACK_MAX_RANGES 8      // rangos SACK por ACK
+#define NACK_DELAY_MS 10      // espera antes de pedir un hueco: puede ser sólo desorden
+#define NACK_BACKOFF_MS 50    // primer reintento del NACK; se duplica mientras no haya progreso
+#define NACK_BACKOFF_MAX_MS 1600
+#define NACK_MAX_TRIES 5      // después el hueco se da por perdido
+#define MAX_MESSAGE (64 * 1024)       // mensaje más grande que se rearma
+#define REASM_SLOTS 16                // mensajes fragmentados a medio rearmar
+#define REASM_MAX_BYTES (1024 * 1024) // tope de memoria para rearmar
 
 typedef enum {
     PKT_HELLO = 1,
@@ -25,9 +39,14 @@ typedef enum {
     PKT_ACK = 5,
     PKT_NACK = 6,
     PKT_PING = 7,
-    PKT_PONG = 8
+    PKT_PONG = 8,
+    PKT_FRAMES = 9     // payload: varios frames (DATA/ACK/NACK/...) seguidos
 } pkt_type_t;
 
+#define F_FRAG 0x02   // DATA con un fragmento de un mensaje más grande que MAX_PAYLOAD
+#define F_RETAIN 0x04 // DATA con el valor retenido del tópico (o publicado como tal)
+#define F_GAP 0x10    // DATA del broker: las seq desde la del payload hasta esta se compactaron
+
 #pragma pack(push, 1)
 typedef struct {
     uint32_t magic;
@@ -39,8 +58,26 @@ typedef struct {
     uint64_t seq;
     uint32_t length;
 } quic_like_header_t;
+
+// Frame dentro de un PKT_FRAMES (va cifrado junto con su payload)
+typedef struct {
+    uint8_t  type;
+    uint8_t  flags;
+    uint16_t length;
+    uint32_t stream_id;
+    uint64_t seq;
+} quic_like_frame_t;
+
+// Encabezado de un fragmento, al principio del payload de un DATA con F_FRAG
+typedef struct {
+    uint64_t msg_id;     // igual en todos los fragmentos del mensaje
+    uint32_t total;      // largo del mensaje completo
+    uint32_t offset;     // posición de este fragmento (múltiplo de FRAG_DATA)
+} quic_like_frag_t;
 #pragma pack(pop)
 
+#define FRAG_DATA (MAX_PAYLOAD - sizeof(quic_like_frag_t))   // bytes de mensaje por fragmento
+
 static uint32_t djb2_hash(const char *s) {
     uint32_t h = 5381u;
     int c;
@@ -49,8 +86,58 @@ static uint32_t djb2_hash(const char *s) {
     return h;
 }
 
+// XOR con la clave repetida en cada byte. Se recorre de a 32, 16 u 8 bytes según lo que
+// soporte la CPU (se elige una vez, en la primera llamada) y el resto byte a byte.
+static size_t xor_words(char *data, size_t len, unsigned char key) {
+    uint64_t k = 0x0101010101010101ull * key;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        w ^= k;
+        memcpy(data + i, &w, 8);
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t xor_avx2(char *data, size_t len, unsigned char key) {
+    __m256i k = _mm256_set1_epi8((char)key);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(v, k));
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static size_t xor_sse2(char *data, size_t len, unsigned char key) {
+    __m128i k = _mm_set1_epi8((char)key);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, k));
+    }
+    return i;
+}
+#endif
+
+static size_t (*xor_wide)(char *, size_t, unsigned char);
+
 static void xor_cipher(char *data, size_t len, unsigned char key) {
-    for (size_t i = 0; i < len; i++) data[i] ^= key;
+    if (!xor_wide) {
+        xor_wide = xor_words;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) xor_wide = xor_avx2;
+        else if (__builtin_cpu_supports("sse2")) xor_wide = xor_sse2;
+#endif
+    }
+    size_t i = xor_wide(data, len, key);
+    i += xor_words(data + i, len - i, key);
+    for (; i < len; i++) data[i] ^= key;
 }
 
 static int send_pkt(int sock, const struct sockaddr_in *addr,
@@ -113,6 +200,314 @@ static int recv_pkt(int sock, struct sockaddr_in *from, quic_like_header_t *out_
     return (int)length;
 }
 
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+// === Recepción en orden (buffer de reordenamiento) + ACK acumulado/SACK ===
+// rx_cum: todo seq <= rx_cum ya se entregó (o se dio por perdido). Lo que llega en
+// (rx_cum, rx_cum + REORDER_WINDOW] se guarda hasta que se complete el hueco de abajo;
+// un bit por seq dice qué llegó. El acumulado arranca con el primer DATA recibido.
+static int      rx_started;
+static uint64_t rx_cum;
+static uint64_t rx_first;     // primera seq de la suscripción
+static uint64_t rx_hi;
+static uint8_t  rx_seen[REORDER_WINDOW / 8];
+static char     rx_buf[REORDER_WINDOW][MAX_PAYLOAD];
+static uint16_t rx_len[REORDER_WINDOW];
+static uint8_t  rx_flags[REORDER_WINDOW];
+
+static int rx_test(uint64_t s) { return rx_seen[(s % REORDER_WINDOW) / 8] >> (s % 8) & 1; }
+static void rx_set(uint64_t s) { rx_seen[(s % REORDER_WINDOW) / 8] |= (uint8_t)(1u << (s % 8)); }
+static void rx_clear(uint64_t s) { rx_seen[(s % REORDER_WINDOW) / 8] &= (uint8_t)~(1u << (s % 8)); }
+
+static void report_lost(uint64_t from, uint64_t to) {
+    fprintf(stderr, "Perdidos seq=%llu-%llu\n", (unsigned long long)from, (unsigned long long)to);
+}
+
+// === Rearmado de mensajes fragmentados ===
+// Cada fragmento es un DATA con su propia seq (se confirma y se reenvía solo). Al
+// entregarse en orden se copia a su lugar en el mensaje; cuando están todos, se muestra.
+// Un mensaje al que le falta algo (p. ej. un fragmento que no llegó al broker) se
+// descarta cuando hace falta lugar (REASM_SLOTS / REASM_MAX_BYTES) o cuando llega otro
+// fragmento más de una ventana de reordenamiento después de su último fragmento.
+typedef struct {
+    uint64_t msg_id;              // 0 = libre
+    uint64_t first_seq, last_seq; // seq del primer y del último fragmento recibidos
+    uint32_t total, got;
+    char    *buf;
+    uint8_t *have;                // un bit por fragmento
+} reasm_t;
+
+static reasm_t reasm[REASM_SLOTS];
+static size_t  reasm_bytes;
+
+static void reasm_drop(reasm_t *m, int incomplete) {
+    if (incomplete)
+        fprintf(stderr, "Mensaje incompleto descartado seq=%llu-%llu (%u de %u bytes)\n",
+                (unsigned long long)m->first_seq, (unsigned long long)m->last_seq,
+                m->got, m->total);
+    reasm_bytes -= m->total;
+    free(m->buf);
+    free(m->have);
+    memset(m, 0, sizeof(*m));
+}
+
+// Busca el mensaje msg_id o le hace lugar (descartando los más viejos)
+static reasm_t *reasm_get(uint64_t msg_id, uint32_t total, uint64_t seq) {
+    reasm_t *free_slot = NULL;
+    for (int i = 0; i < REASM_SLOTS; i++) {
+        reasm_t *m = &reasm[i];
+        if (m->msg_id && m->last_seq + REORDER_WINDOW < seq) reasm_drop(m, 1);
+        if (m->msg_id == msg_id && m->total == total) return m;
+        if (!m->msg_id && !free_slot) free_slot = m;
+    }
+    while (!free_slot || reasm_bytes + total > REASM_MAX_BYTES) {
+        reasm_t *old = NULL;
+        for (int i = 0; i < REASM_SLOTS; i++)
+            if (reasm[i].msg_id && (!old || reasm[i].first_seq < old->first_seq)) old = &reasm[i];
+        if (!old) return NULL;
+        reasm_drop(old, 1);
+        if (!free_slot) free_slot = old;
+    }
+    size_t nfrag = (total + FRAG_DATA - 1) / FRAG_DATA;
+    free_slot->buf = malloc(total);
+    free_slot->have = calloc((nfrag + 7) / 8, 1);
+    if (!free_slot->buf || !free_slot->have) {
+        free(free_slot->buf);
+        free(free_slot->have);
+        free_slot->buf = NULL;
+        free_slot->have = NULL;
+        return NULL;
+    }
+    free_slot->msg_id = msg_id;
+    free_slot->total = total;
+    free_slot->first_seq = seq;
+    reasm_bytes += total;
+    return free_slot;
+}
+
+static void reasm_add(uint64_t seq, const char *p, size_t len) {
+    quic_like_frag_t fh;
+    if (len < sizeof(fh)) return;
+    memcpy(&fh, p, sizeof(fh));
+    uint64_t msg_id = be64toh(fh.msg_id);
+    uint32_t total = ntohl(fh.total), off = ntohl(fh.offset);
+    size_t n = len - sizeof(fh);
+    if (msg_id == 0 || total == 0 || total > MAX_MESSAGE || off % FRAG_DATA ||
+        off + n > total || (n != FRAG_DATA && off + n != total))
+        return;
+
+    reasm_t *m = reasm_get(msg_id, total, seq);
+    if (!m) return;
+    size_t i = off / FRAG_DATA;
+    if (m->have[i / 8] >> (i % 8) & 1) return;   // fragmento repetido
+    m->have[i / 8] |= (uint8_t)(1u << (i % 8));
+    memcpy(m->buf + off, p + sizeof(fh), n);
+    m->got += (uint32_t)n;
+    m->last_seq = seq;
+    if (m->got == m->total) {
+        printf("[seq=%llu-%llu] %.*s\n", (unsigned long long)m->first_seq,
+               (unsigned long long)seq, (int)m->total, m->buf);
+        reasm_drop(m, 0);
+    }
+}
+
+// Entrega lo que quedó contiguo al acumulado
+static void rx_deliver_ready(void) {
+    while (rx_test(rx_cum + 1)) {
+        uint64_t s = ++rx_cum;
+        rx_clear(s);
+        size_t i = s % REORDER_WINDOW;
+        if (rx_flags[i] & F_FRAG) reasm_add(s, rx_buf[i], rx_len[i]);
+        else if (!(rx_flags[i] & F_GAP)) printf("[seq=%llu] %.*s\n", (unsigned long long)s, (int)rx_len[i], rx_buf[i]);
+    }
+}
+
+// Lleva el acumulado hasta ncum: entrega lo guardado y da por perdido lo que falta
+static void rx_skip_to(uint64_t ncum) {
+    while (rx_cum < ncum) {
+        if (rx_test(rx_cum + 1)) {
+            rx_deliver_ready();
+            continue;
+        }
+        // El hueco entero (hasta el próximo recibido) se da por perdido de una vez
+        uint64_t from = rx_cum + 1, to = from;
+        while (to < rx_hi && !rx_test(to + 1)) to++;
+        if (to >= rx_hi && to < ncum) to = ncum;   // arriba no hay nada guardado
+        report_lost(from, to);
+        rx_cum = to;
+    }
+    if (rx_hi < rx_cum) rx_hi = rx_cum;
+    rx_deliver_ready();
+}
+
+// F_GAP: las seq [desde, seq] ya no existen en el historial del broker (se guardó un
+// mensaje más nuevo con la misma clave). Quedan como recibidas y vacías: el acumulado y los
+// SACK pasan por encima sin pedirlas.
+static int rx_gap(uint64_t seq, const char *payload, int len) {
+    uint64_t from;
+    if (len != (int)sizeof(from)) return 0;
+    memcpy(&from, payload, sizeof(from));
+    from = be64toh(from);
+    if (from <= rx_cum) from = rx_cum + 1;
+    int fresh = 0;
+    for (uint64_t s = from; s <= seq; ++s) {
+        if (rx_test(s)) continue;
+        rx_len[s % REORDER_WINDOW] = 0;
+        rx_flags[s % REORDER_WINDOW] = F_GAP;
+        rx_set(s);
+        fresh = 1;
+    }
+    if (seq > rx_hi) rx_hi = seq;
+    rx_deliver_ready();
+    return fresh;
+}
+
+// Registra un DATA. Devuelve 1 si es nuevo, 0 si es duplicado.
+static int rx_mark(uint64_t seq, uint8_t flags, const char *payload, int len) {
+    // El valor retenido que manda el broker al suscribirse es anterior a la primera seq
+    // de la suscripción: se muestra una vez y no entra en el acumulado.
+    if ((flags & F_RETAIN) && (!rx_started || seq < rx_first)) {
+        static int retained_shown;
+        if (retained_shown) return 0;
+        retained_shown = 1;
+        printf("[retenido seq=%llu] %.*s\n", (unsigned long long)seq, len, payload);
+        return 1;
+    }
+    if (!rx_started) {
+        rx_started = 1;
+        rx_first = seq;
+        rx_cum = rx_hi = seq - 1;
+    }
+    if (seq <= rx_cum) return 0;
+    // Ventana llena: lo más viejo que falta se da por perdido para hacer lugar
+    if (seq > rx_cum + REORDER_WINDOW) rx_skip_to(seq - REORDER_WINDOW);
+    if (flags & F_GAP) return rx_gap(seq, payload, len);
+    if (rx_test(seq)) return 0;
+
+    memcpy(rx_buf[seq % REORDER_WINDOW], payload, (size_t)len);
+    rx_len[seq % REORDER_WINDOW] = (uint16_t)len;
+    rx_flags[seq % REORDER_WINDOW] = flags;
+    rx_set(seq);
+    if (seq > rx_hi) rx_hi = seq;
+    rx_deliver_ready();
+    return 1;
+}
+
+// "ACK:<acumulado>;a-b;..." con los rangos recibidos por encima del acumulado, de mayor a menor
+static int build_ack(char *out, size_t cap) {
+    int n = snprintf(out, cap, "ACK:%llu", (unsigned long long)rx_cum);
+    uint64_t s = rx_hi;
+    for (int ranges = 0; s > rx_cum && ranges < ACK_MAX_RANGES; ) {
+        if (!rx_test(s)) { s--; continue; }
+        uint64_t b = s;
+        while (s > rx_cum && rx_test(s)) s--;
+        n += snprintf(out + n, cap - (size_t)n, ";%llu-%llu",
+                      (unsigned long long)(s + 1), (unsigned long long)b);
+        ranges++;
+    }
+    return n;
+}
+
+// ¿Quedan datagramas esperando en el socket?
+static int more_pending(int sock) {
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// === Frames de salida: el ACK, el NACK y el PONG de una vuelta van en un solo datagrama ===
+static char     fr_buf[MAX_PAYLOAD];
+static uint32_t fr_len;
+static int      fr_count;
+
+static void fr_add(pkt_type_t type, uint32_t stream_id, const char *payload, size_t len) {
+    if (fr_len + sizeof(quic_like_frame_t) + len > sizeof(fr_buf)) return;
+    quic_like_frame_t f;
+    f.type = (uint8_t)type;
+    f.flags = 0;
+    f.length = htons((uint16_t)len);
+    f.stream_id = htonl(stream_id);
+    f.seq = 0;
+    memcpy(fr_buf + fr_len, &f, sizeof(f));
+    memcpy(fr_buf + fr_len + sizeof(f), payload, len);
+    fr_len += (uint32_t)(sizeof(f) + len);
+    fr_count++;
+}
+
+// Un frame solo sale como paquete común; varios, como PKT_FRAMES.
+static void fr_flush(int sock, const struct sockaddr_in *srv, unsigned char key) {
+    if (fr_count == 1) {
+        quic_like_frame_t f;
+        memcpy(&f, fr_buf, sizeof(f));
+        (void)send_pkt(sock, srv, (pkt_type_t)f.type, f.flags, ntohl(f.stream_id),
+                       be64toh(f.seq), fr_buf + sizeof(f), ntohs(f.length), key, 1);
+    } else if (fr_count > 1) {
+        (void)send_pkt(sock, srv, PKT_FRAMES, 0, 0, 0, fr_buf, fr_len, key, 1);
+    }
+    fr_len = 0;
+    fr_count = 0;
+}
+
+// === NACK: un pedido por intervalo para todos los huecos, con backoff ===
+// Un hueco no se pide enseguida (el paquete puede venir sólo desordenado). Después se
+// manda un único NACK desde el acumulado hasta el último faltante (el broker salta lo
+// que ya confirmamos por SACK) y se reintenta con espera creciente mientras el
+// acumulado no avance. Así una ráfaga desordenada no dispara NACK por cada paquete.
+static uint64_t nack_at;        // cuándo mandar el próximo NACK (0 = no hay huecos)
+static uint64_t nack_gap;       // acumulado cuando se armó (si avanza, se reinicia)
+static uint64_t nack_backoff;
+static int      nack_tries;
+
+static void nack_update(uint64_t now) {
+    if (rx_hi <= rx_cum) {
+        nack_at = 0;
+        return;
+    }
+    if (nack_at == 0 || nack_gap != rx_cum) {
+        nack_gap = rx_cum;
+        nack_tries = 0;
+        nack_backoff = NACK_BACKOFF_MS;
+        nack_at = now + NACK_DELAY_MS;
+    }
+}
+
+static void nack_fire(uint32_t stream_id, uint64_t now) {
+    if (nack_tries >= NACK_MAX_TRIES) {
+        // No llegó (quizá ya no está en el historial del broker): se salta el primer hueco
+        uint64_t s = rx_cum + 1;
+        while (s < rx_hi && !rx_test(s)) s++;
+        rx_skip_to(s - 1);
+        nack_at = 0;
+        nack_update(now);
+        return;
+    }
+    uint64_t last = rx_hi - 1;
+    while (last > rx_cum && rx_test(last)) last--;
+
+    char nack[64];
+    snprintf(nack, sizeof(nack), "NACK:%llu-%llu",
+             (unsigned long long)(rx_cum + 1), (unsigned long long)last);
+    fr_add(PKT_NACK, stream_id, nack, strlen(nack));
+    nack_tries++;
+    nack_at = now + nack_backoff;
+    nack_backoff *= 2;
+    if (nack_backoff > NACK_BACKOFF_MAX_MS) nack_backoff = NACK_BACKOFF_MAX_MS;
+}
+
+// NACK (si toca) y ACK al día, juntos
+static void send_feedback(int sock, const struct sockaddr_in *srv, uint32_t stream_id,
+                          unsigned char key, uint64_t now)
+{
+    if (nack_at && now >= nack_at) nack_fire(stream_id, now);
+    char ack[512];
+    int alen = build_ack(ack, sizeof(ack));
+    fr_add(PKT_ACK, stream_id, ack, (size_t)alen);
+    fr_flush(sock, srv, key);
+}
+
 // === Handshake: obtener clave XOR del broker ===
 static int do_handshake_get_key(int sock, const struct sockaddr_in *srv, unsigned char *out_key)
 {
@@ -138,6 +533,13 @@ int main(int argc, char **argv)
 {
     const char *broker_ip = IP_BROKER;
     int broker_port = PORT;
+    // --from=earliest|latest|<seq>|@<ms>: desde dónde empezar (por defecto sólo lo nuevo)
+    const char *start_at = NULL;
+    if (argc > 1 && strncmp(argv[1], "--from=", 7) == 0) {
+        start_at = argv[1] + 7;
+        argc--;
+        argv++;
+    }
     if (argc == 3) { broker_ip = argv[1]; broker_port = atoi(argv[2]); }
 
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -161,7 +563,7 @@ int main(int argc, char **argv)
     }
     printf("Clave recibida: %u\n", key);
 
-    // 2) pedir tópico y suscribirse (SUB:<stream_id>) cifrado
+    // 2) pedir tópico y suscribirse (SUB:<stream_id>[:<desde>]) cifrado
     char topic[128];
     printf("Tema a suscribirse (ej: EquipoAvsB): ");
     if (!fgets(topic, sizeof(topic), stdin)) return 0;
@@ -169,7 +571,8 @@ int main(int argc, char **argv)
     uint32_t stream_id = djb2_hash(topic);
 
     char submsg[64];
-    snprintf(submsg, sizeof(submsg), "SUB:%u", stream_id);
+    if (start_at) snprintf(submsg, sizeof(submsg), "SUB:%u:%s", stream_id, start_at);
+    else snprintf(submsg, sizeof(submsg), "SUB:%u", stream_id);
     if (send_pkt(sockfd, &srv, PKT_SUBSCRIBE, 0, stream_id, 0,
                  submsg, (uint32_t)strlen(submsg), key, 1) != 0) {
         fprintf(stderr, "Error enviando SUBSCRIBE\n");
@@ -177,16 +580,22 @@ int main(int argc, char **argv)
     }
     printf("Suscrito a stream_id=%u\n", stream_id);
 
-    // 3) recibir DATA + NACK en caso de huecos
-    uint64_t next_expected = 1;
-
+    // 3) recibir DATA, entregarlos en orden y pedir los huecos con NACK
+    int ack_pending = 0;
     for (;;) {
         struct sockaddr_in from;
         quic_like_header_t hdr;
         char payload[MAX_PAYLOAD];
-        int r = recv_pkt(sockfd, &from, &hdr, payload, sizeof(payload), key,
-                         /*decrypt*/ (hdr.type == PKT_DATA || hdr.type == PKT_ACK ||
-                                      hdr.type == PKT_NACK || hdr.type == PKT_PING || hdr.type == PKT_PONG));
+
+        // Esperar datos, pero no más allá del próximo NACK
+        uint64_t now = now_ms();
+        if (nack_at && now >= nack_at) send_feedback(sockfd, &srv, stream_id, key, now);
+        if (nack_at) {
+            struct pollfd pfd = { sockfd, POLLIN, 0 };
+            if (poll(&pfd, 1, (int)(nack_at - now)) == 0) continue;
+        }
+        // Después del handshake todo lo que manda el broker viene cifrado
+        int r = recv_pkt(sockfd, &from, &hdr, payload, sizeof(payload), key, /*decrypt*/ 1);
         if (r < 0) {
             if (errno == EWOULDBLOCK || errno == EAGAIN) continue;
             perror("recv");
@@ -194,39 +603,60 @@ int main(int argc, char **argv)
         }
 
         switch (hdr.type) {
-            case PKT_DATA: {
-                // manejar huecos
-                if (hdr.seq > next_expected) {
-                    // pedir retransmisión
-                    char nack[64];
-                    snprintf(nack, sizeof(nack), "NACK:%llu-%llu",
-                             (unsigned long long)next_expected,
-                             (unsigned long long)(hdr.seq - 1));
-                    (void)send_pkt(sockfd, &srv, PKT_NACK, 0, hdr.stream_id, 0,
-                                   nack, (uint32_t)strlen(nack), key, 1);
+            case PKT_DATA:
+                // Los duplicados se descartan; los nuevos se muestran en orden de seq.
+                if (hdr.stream_id != stream_id) break;
+                (void)rx_mark(hdr.seq, hdr.flags, payload, r);
+                ack_pending = 1;
+                break;
+            case PKT_FRAMES: {
+                // Varios mensajes en un datagrama: cada frame como si fuera su propio paquete
+                size_t off = 0;
+                while (off + sizeof(quic_like_frame_t) <= (size_t)r) {
+                    quic_like_frame_t f;
+                    memcpy(&f, payload + off, sizeof(f));
+                    off += sizeof(f);
+                    size_t len = ntohs(f.length);
+                    if (len > (size_t)r - off) break;
+                    if (f.type == PKT_DATA && ntohl(f.stream_id) == stream_id) {
+                        (void)rx_mark(be64toh(f.seq), f.flags, payload + off, (int)len);
+                        ack_pending = 1;
+                    } else if (f.type == PKT_PING) {
+                        fr_add(PKT_PONG, 0, "PONG", 4);
+                    }
+                    off += len;
                 }
-                // mostrar mensaje
-                printf("[seq=%llu] %.*s\n",
-                       (unsigned long long)hdr.seq, r, payload);
-                next_expected = hdr.seq + 1;
-
-                // (opcional) mandar ACK
-                // char ack[32]; snprintf(ack, sizeof(ack), "ACK:%llu", (unsigned long long)hdr.seq);
-                // (void)send_pkt(sockfd, &srv, PKT_ACK, 0, hdr.stream_id, hdr.seq, ack, (uint32_t)strlen(ack), key, 1);
                 break;
             }
             case PKT_ACK:
-                // opcional: stats
+                // "SUB_OK:<seq>": la primera seq que manda el broker. Se arranca el acumulado
+                // ahí para que un hueco al principio del backlog también se pida por NACK.
+                if (hdr.stream_id == stream_id && !rx_started && r > 7 &&
+                    strncmp(payload, "SUB_OK:", 7) == 0 && hdr.seq > 0) {
+                    rx_started = 1;
+                    rx_first = hdr.seq;
+                    rx_cum = rx_hi = hdr.seq - 1;
+                }
                 break;
-            case PKT_PING: {
-                const char pong[] = "PONG";
-                (void)send_pkt(sockfd, &srv, PKT_PONG, 0, 0, 0, pong, (uint32_t)strlen(pong), key, 1);
+            case PKT_PING:
+                fr_add(PKT_PONG, 0, "PONG", 4);
                 break;
-            }
             default:
                 // ignora otros
                 break;
         }
+
+        // Un ACK (acumulado + SACK) por ráfaga: se manda cuando no queda nada más en el
+        // socket. También cuenta los duplicados: el ACK anterior pudo perderse.
+        if (!more_pending(sockfd)) {
+            if (ack_pending) {
+                uint64_t t = now_ms();
+                nack_update(t);
+                send_feedback(sockfd, &srv, stream_id, key, t);
+                ack_pending = 0;
+            }
+            fr_flush(sockfd, &srv, key);
+        }
     }
 
     close(sockfd);
@@ -1,119 +1,2336 @@
 // broker_tcp.c
+#define _GNU_SOURCE   // pthread_setaffinity_np / CPU_SET
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 
 //Número del puerto donde esta escuchando
-//FD_SETSIZE es una constante del sistema Linux=1024
 //Buffer del broker
 //Tamaño máximo de la longitud del tema.
+//Cuántos eventos devuelve epoll_wait() como máximo en cada llamada.
+//Tope de la tabla de clientes si el límite de descriptores es "infinito".
 #define PORT 5927
-#define MAX_CLIENTS  FD_SETSIZE
 #define BUF_SIZE     2048
 #define TOPIC_SIZE   64
+#define MAX_EVENTS   1024
+#define MAX_FDS_CAP  (1 << 20)
+#define TOPIC_BUCKETS_INIT 1024
+#define MAX_SUBS_PER_CLIENT 4096
+#define IN_SCRATCH   (64 * 1024)   // lectura directa cuando el cliente no tiene una línea a medias
+#define IN_READ_MIN  4096          // espacio libre mínimo antes de cada recv() en el buffer propio
+#define IN_BUF_MAX   (1024 * 1024) // línea más larga aceptada; más que eso cierra la conexión
+#define OUTQ_LEN_DEFAULT 1024      // mensajes en cola por suscriptor (configurable con --queue=N)
+#define FLUSH_IOV    64            // mensajes por writev() al vaciar la cola
+#define MAX_WORKERS  256           // hilos/shards como máximo (--workers=N)
+#define LOG_SEGMENT_DEFAULT (64 * 1024 * 1024) // tamaño de un segmento del log (--log-segment=N)
+#define LOG_SYNC_MS_DEFAULT 10     // group commit: un fsync cada tantos ms (--log-sync-ms=N)
+#define LOG_INDEX_EVERY 4096       // una entrada del índice disperso cada tantos bytes de segmento
+#define LOG_BATCH    256           // registros por writev() de un tema
+#define LOG_DRAIN    4096          // publicaciones que el hilo del log saca del inbox por vuelta
+#define REPLAY_BATCH 1024          // registros por vuelta al reproducir el log a un cliente
 
 
 //Definir un enum para tener claridad en que es cada cliente conectado al broker, un pub o un sub.
 typedef enum { ROLE_UNKNOWN=0, ROLE_SUB, ROLE_PUB } Role;
 
+// Qué hacer cuando la cola de salida de un suscriptor está llena (--policy=...).
+typedef enum { OVERFLOW_DROP_OLDEST=0, OVERFLOW_DROP_NEWEST, OVERFLOW_DISCONNECT } OverflowPolicy;
+
+// ====== Modo binario ======
+// Se negocia al conectar: el cliente manda la línea "HELLO BIN" y el broker responde "OK BIN".
+// Desde ahí la conexión usa frames con encabezado fijo (orden de red) seguido del tema y del
+// payload. El broker lee el encabezado en O(1) y reenvía el payload como bytes opacos
+// (puede contener '\n' o cualquier byte).
+typedef enum {
+    BIN_SUB   = 1,  // cliente → broker: tema [+ posición de inicio, como en SUBSCRIBE ... FROM]
+    BIN_UNSUB = 2,  // cliente → broker: tema
+    BIN_PUB   = 3,  // cliente → broker: tema + payload
+    BIN_MSG   = 4,  // broker → suscriptor: tema + payload
+    BIN_OK    = 5,  // broker → cliente: tema + texto de estado
+    BIN_ERR   = 6,  // broker → cliente: tema + texto de error
+    BIN_REPLAY = 7  // cliente → broker: tema + offset desde el que reproducir el log (8 bytes, opcional)
+} BinOp;
+
+#define BIN_F_RETAIN 0x01   // en BIN_PUB: el mensaje queda como último valor del tema (como RETAIN)
+
+#pragma pack(push, 1)
+typedef struct {
+    uint8_t  op;
+    uint8_t  flags;
+    uint16_t topic_len;
+    uint32_t payload_len;
+} BinHeader;
+#pragma pack(pop)
+
+// Bloque de mensaje inmutable con conteo de referencias. Se reserva una sola vez por
+// publicación y todas las colas de los suscriptores apuntan al mismo bloque; se libera
+// cuando el último suscriptor termina de enviarlo.
+// Con varios workers el mismo bloque llega a colas de distintos hilos: el contador es atómico.
+//
+// Una publicación se guarda con el frame binario completo y, a continuación, el '\n' del modo
+// texto y el tema terminado en '\0':
+//     [BinHeader][tema][payload]['\n'][tema'\0']
+//     \_______________ frame ______/
+//                       \__ text __/
+// Así un solo bloque sirve para suscriptores binarios y de texto, sin otra copia.
+typedef struct {
+    atomic_int  refs;
+    size_t      len;
+    size_t      frame_len;   // bytes del frame binario (desde data)
+    const char *text;        // payload + '\n' para clientes de texto
+    size_t      text_len;
+    const char *topic;       // tema terminado en '\0'
+    uint64_t    offset;      // offset en el log del tema (con --log-dir; si no, 0)
+    int         retain;      // publicado con RETAIN: queda como último valor del tema
+    char        data[];
+} Msg;
+
+// Mensaje pendiente de enviar a un cliente: referencia al bloque compartido y el tramo
+// (texto o frame binario) que le corresponde.
+typedef struct {
+    Msg        *m;
+    const char *data;
+    size_t      len;
+} OutMsg;
+
 //Struct para representar la información de un cliente conectado al broker.
 // Cada conexión aceptada con accept() devuelve un fd único, 
 //     que se usa en send() y recv() para enviar/recibir datos del cliente.
 
+// Lista compacta de suscriptores. Cada entrada guarda el fd y la posición (slot)
+// de esa suscripción dentro de clients[fd].subs, para poder borrar en O(1) desde ambos lados.
+// from: en vivo sólo se entregan las publicaciones con offset >= from; lo anterior le llega
+// desde el log (SUBSCRIBE ... FROM). Vale 0 en las suscripciones comunes.
+typedef struct {
+    int      fd;
+    int      slot;
+    uint64_t from;
+} SubEntry;
+
+typedef struct {
+    SubEntry *v;
+    int       n, cap;
+} SubList;
+
+// Registro de temas exactos: tabla hash de nombre de tema → lista compacta de suscriptores.
+// El nombre se guarda una sola vez (interned) y cada suscripción apunta a su Topic.
+// Así publicar cuesta O(suscriptores del tema) y no O(clientes conectados).
+typedef struct Topic {
+    struct Topic *next;   // siguiente en el mismo bucket (encadenamiento)
+    uint32_t hash;
+    SubList  subs;
+    char     name[];      // nombre del tema
+} Topic;
+
+// Trie de patrones jerárquicos: un nivel por segmento separado por '/'.
+//   '*' coincide con exactamente un nivel   (liga/*/goles)
+//   '#' coincide con el resto de niveles     (liga/#), sólo puede ir al final
+// Los hijos literales se buscan en una tabla hash de aristas (padre, segmento),
+// '*' y '#' cuelgan directo del nodo. Publicar sólo recorre las ramas que coinciden.
+typedef struct TNode {
+    struct TNode *next;   // siguiente en el bucket de la tabla de aristas
+    struct TNode *parent;
+    struct TNode *star;   // hijo '*'
+    struct TNode *rest;   // hijo '#'
+    uint32_t hash;        // hash de la arista (padre, segmento)
+    int      nchild;      // hijos literales
+    SubList  subs;
+    char     seg[];
+} TNode;
+
+// Una suscripción de un cliente: a un tema exacto o a un nodo del trie.
 typedef struct {
-    int   fd;
-    Role  role;
-    char  topic[TOPIC_SIZE];
+    Topic *topic;
+    TNode *node;
+    int    pos;           // posición dentro de la SubList correspondiente
+} Sub;
+
+typedef struct {
+    int      fd;
+    Role     role;
+    Sub     *subs;        // suscripciones del cliente
+    int      nsubs, cap;
+    uint64_t last_pub;    // id de la última publicación entregada (evita duplicados)
+    char    *in;          // línea incompleta pendiente entre lecturas (NULL si no hay)
+    size_t   in_len, in_cap;
+    OutMsg  *outq;        // cola circular de salida (se reserva al primer mensaje encolado)
+    int      out_head, out_count;
+    size_t   out_off;     // bytes del mensaje de la cabeza que ya se enviaron
+    int      dead;        // marcado para cerrar al final de la vuelta del loop
+    int      binary;      // 1 si negoció el modo binario (HELLO BIN)
+    char    *replay;      // tema que se le está reproduciendo desde el log (NULL = ninguno)
+    uint64_t replay_next; // próximo offset a mandarle
+    uint64_t replay_base, replay_pos;  // segmento y posición donde quedó la lectura
+    struct Topic *catchup;  // SUBSCRIBE ... FROM en curso: tema que se pone al día desde el log
+    Msg    **held;        // lo en vivo de ese tema que llegó mientras tanto (sale después)
+    int      nheld;
 } Client;
 
-static Client clients[MAX_CLIENTS];
+// Publicación que un worker le pasa a otro: el bloque (referencia propia) y el tema.
+typedef struct XNode {
+    struct XNode *_Atomic next;
+    Msg  *msg;            // el tema viaja dentro del bloque (msg->topic)
+    struct TopicLog *log; // log del tema (sólo en el inbox del hilo del log)
+} XNode;
+
+// Inbox: cola MPSC sin locks (varios productores, un consumidor) y un eventfd para despertar
+// al hilo que la atiende.
+typedef struct {
+    int        evfd;
+    XNode *_Atomic head;       // último nodo insertado (lado productores)
+    XNode     *tail;           // próximo nodo a sacar (lado consumidor)
+    XNode      stub;
+    atomic_int wake_pending;   // 1 si ya hay un aviso en el eventfd sin atender
+} Inbox;
+
+// Cada worker (shard) es un hilo con su propio socket de escucha (SO_REUSEPORT), su propia
+// instancia epoll, sus conexiones y su propio registro de temas. Las publicaciones hacia los
+// suscriptores de otros shards pasan por el inbox del destino.
+typedef struct {
+    int        id;
+    int        listenfd;
+    Inbox      inbox;
+    atomic_int nsubs;          // suscripciones vivas en el shard (0 = no hace falta enviarle nada)
+    pthread_t  thread;
+} Worker;
+
+// Último valor retenido de un tema (RETAIN): la clave es el tema del propio bloque.
+typedef struct Retained {
+    struct Retained *next;        // siguiente en el bucket
+    uint32_t hash;
+    Msg     *msg;
+} Retained;
+
+// ====== Log persistente por tema (--log-dir=DIR) ======
+// Cada tema tiene un directorio con segmentos de sólo-agregado:
+//     DIR/<tema>/<offset base>.log   registros [LogRec][payload] seguidos
+//     DIR/<tema>/<offset base>.idx   índice disperso: una LogIdx cada LOG_INDEX_EVERY bytes
+// Todos los campos van en orden de red.
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t len;       // bytes de payload
+    uint32_t crc;       // crc32 de offset, ts y payload: detecta un registro cortado por un crash
+    uint64_t offset;    // número del mensaje dentro del tema (0, 1, 2...)
+    uint64_t ts_ms;     // hora de llegada (ms desde epoch)
+} LogRec;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t pos;       // posición del registro en el segmento
+} LogIdx;
+#pragma pack(pop)
+
+typedef struct {
+    uint64_t base;      // offset del primer registro
+    uint64_t size;      // bytes escritos (lo que pueden leer los lectores)
+} LogSeg;
+
+// Log de un tema. segs, next_offset, pub_offset y failed los comparten los workers y el hilo
+// del log (bajo log_lock); el resto es del hilo del log, que es el único que escribe.
+typedef struct TopicLog {
+    struct TopicLog *next;        // siguiente en el bucket
+    uint32_t hash;
+    LogSeg  *segs;
+    int      nsegs, segs_cap;
+    uint64_t next_offset;         // offset del próximo registro visible
+    uint64_t pub_offset;          // offset de la próxima publicación (se asigna al publicar)
+    int      failed;              // se dejó de escribir (error de disco) hasta reiniciar
+    int      fd, idx_fd;          // segmento activo (-1 si no se pudo abrir)
+    uint64_t write_offset;        // próximo offset a asignar (incluye la tanda pendiente)
+    uint64_t write_pos;           // tamaño del segmento activo contando la tanda pendiente
+    uint64_t index_pos;           // posición de la última entrada del índice (UINT64_MAX = ninguna)
+    struct iovec *iov;            // tanda pendiente: encabezado + payload por registro
+    LogRec  *hdr;
+    Msg    **held;                // bloques de la tanda (se sueltan después del writev)
+    LogIdx  *idx;
+    int      npend, nidx;
+    struct TopicLog *pend_next;   // lista de temas con tanda pendiente
+    int      pending;
+    struct TopicLog *sync_next;   // lista de temas escritos y todavía sin fsync
+    int      unsynced;
+    Msg     *retain_pend;         // último RETAIN de la tanda: se guarda al terminarla
+    char     name[];
+} TopicLog;
+
+// La tabla de clientes se indexa directamente con el fd: clients[fd].
+// Así encontrar al cliente de un evento es O(1) y no hay que recorrer el arreglo.
+// Su tamaño es el límite de descriptores del proceso (RLIMIT_NOFILE), no FD_SETSIZE.
+// Es compartida por todos los workers, pero cada fd sólo lo toca el worker que lo aceptó.
+static Client *clients;
+static int     max_clients;
+
+static Worker *workers;
+static int     nworkers = 1;
+
+// Lo que sigue es estado propio de cada worker (__thread: una copia por hilo).
+static __thread Worker *self;
+
+// Descriptor de la instancia epoll.
+static __thread int epfd = -1;
+
+// Tamaño de la cola de salida y política de desborde (configurables por línea de comandos).
+static int            outq_len = OUTQ_LEN_DEFAULT;
+static OverflowPolicy overflow_policy = OVERFLOW_DROP_OLDEST;
+
+// Clientes marcados con client_kill(); se cierran en reap_clients(), fuera de los recorridos
+// de listas de suscriptores (cerrar en medio de un broadcast movería las entradas).
+static __thread int *reap_fds;
+static __thread int  reap_n, reap_cap;
+
+// Buckets de la tabla hash de temas; crece al doble cuando hay más temas que buckets.
+static __thread Topic **topic_table;
+static __thread size_t  topic_buckets, topic_count;
+
+// Raíz del trie y tabla de aristas (misma estrategia de crecimiento).
+static __thread TNode   trie_root;
+static __thread TNode **edge_table;
+static __thread size_t  edge_buckets, edge_count;
+
+// Contador de publicaciones, para entregar una sola vez aunque coincidan varios patrones.
+static __thread uint64_t pub_counter;
+
+// Log persistente (ver TopicLog). log_dir NULL = desactivado.
+static const char *log_dir;
+static uint64_t    log_segment = LOG_SEGMENT_DEFAULT;
+static int         log_sync_ms = LOG_SYNC_MS_DEFAULT;
+static uint64_t    log_retain;          // bytes por tema (0 = sin límite): se borran los segmentos más viejos
+static Inbox       log_inbox;           // publicaciones para el hilo del log
+static pthread_t   log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;  // tabla de logs y sus segmentos
+static TopicLog  **log_table;
+static size_t      log_buckets, log_count;
+static TopicLog   *log_pending, *log_unsynced;   // sólo del hilo del log
+static uint64_t    log_now;             // hora de la tanda en curso (ms desde epoch)
+static uint32_t    crc_table[256];
+
+// Valores retenidos (RETAIN), compartidos por todos los workers.
+static pthread_mutex_t retain_lock = PTHREAD_MUTEX_INITIALIZER;
+static Retained  **retain_table;
+static size_t      retain_buckets, retain_count;
+
+// Mismo hash djb2 que usa QUIC/ para los stream_id (versión con longitud explícita).
+static uint32_t djb2_hash_n(const char *s, size_t len) {
+    uint32_t h = 5381u;
+    for (size_t i = 0; i < len; ++i)
+        h = ((h << 5) + h) + (uint32_t)(unsigned char)s[i];
+    return h;
+}
+
+static uint32_t edge_hash(const TNode *parent, const char *seg, size_t len) {
+    uintptr_t p = (uintptr_t)parent;
+    return djb2_hash_n(seg, len) ^ (uint32_t)((p >> 4) * 2654435761u);
+}
+
+// Reserva una tabla de buckets (nb potencia de 2).
+static void *table_alloc(size_t nb) {
+    void *t = calloc(nb, sizeof(void*));
+    if (!t) { perror("calloc"); exit(1); }
+    return t;
+}
+
+static void registry_init(void) {
+    // Llamada por cada worker al arrancar: la tabla y el trie son propios del hilo.
+    topic_table = table_alloc(TOPIC_BUCKETS_INIT);
+    topic_buckets = TOPIC_BUCKETS_INIT;
+    edge_table = table_alloc(TOPIC_BUCKETS_INIT);
+    edge_buckets = TOPIC_BUCKETS_INIT;
+}
+
+static void topic_table_grow(void) {
+    size_t nb = topic_buckets * 2;
+    Topic **nt = calloc(nb, sizeof(Topic*));
+    if (!nt) return; // seguimos con la tabla actual, sólo más cargada
+    for (size_t i = 0; i < topic_buckets; ++i) {
+        Topic *t = topic_table[i];
+        while (t) {
+            Topic *next = t->next;
+            t->next = nt[t->hash & (nb - 1)];
+            nt[t->hash & (nb - 1)] = t;
+            t = next;
+        }
+    }
+    free(topic_table);
+    topic_table = nt;
+    topic_buckets = nb;
+}
+
+static void edge_table_grow(void) {
+    size_t nb = edge_buckets * 2;
+    TNode **nt = calloc(nb, sizeof(TNode*));
+    if (!nt) return;
+    for (size_t i = 0; i < edge_buckets; ++i) {
+        TNode *e = edge_table[i];
+        while (e) {
+            TNode *next = e->next;
+            e->next = nt[e->hash & (nb - 1)];
+            nt[e->hash & (nb - 1)] = e;
+            e = next;
+        }
+    }
+    free(edge_table);
+    edge_table = nt;
+    edge_buckets = nb;
+}
+
+// Busca un tema exacto (len bytes de name); si create != 0 y no existe, lo crea.
+static Topic *topic_lookup(const char *name, size_t len, int create) {
+    uint32_t h = djb2_hash_n(name, len);
+    for (Topic *t = topic_table[h & (topic_buckets - 1)]; t; t = t->next)
+        if (t->hash == h && strncmp(t->name, name, len) == 0 && t->name[len] == '\0') return t;
+    if (!create) return NULL;
 
+    Topic *t = calloc(1, sizeof(Topic) + len + 1);
+    if (!t) return NULL;
+    memcpy(t->name, name, len);
+    t->name[len] = '\0';
+    t->hash = h;
+    t->next = topic_table[h & (topic_buckets - 1)];
+    topic_table[h & (topic_buckets - 1)] = t;
+    if (++topic_count > topic_buckets) topic_table_grow();
+    return t;
+}
+
+// Saca el tema de la tabla y lo libera (cuando se queda sin suscriptores).
+static void topic_free(Topic *t) {
+    Topic **pp = &topic_table[t->hash & (topic_buckets - 1)];
+    while (*pp && *pp != t) pp = &(*pp)->next;
+    if (*pp) *pp = t->next;
+    --topic_count;
+    free(t->subs.v);
+    free(t);
+}
+
+// Hijo literal de parent con el segmento seg[0..len); lo crea si create != 0.
+static TNode *trie_child(TNode *parent, const char *seg, size_t len, int create) {
+    uint32_t h = edge_hash(parent, seg, len);
+    for (TNode *e = edge_table[h & (edge_buckets - 1)]; e; e = e->next)
+        if (e->hash == h && e->parent == parent &&
+            strncmp(e->seg, seg, len) == 0 && e->seg[len] == '\0') return e;
+    if (!create) return NULL;
+
+    TNode *n = calloc(1, sizeof(TNode) + len + 1);
+    if (!n) return NULL;
+    memcpy(n->seg, seg, len);
+    n->seg[len] = '\0';
+    n->parent = parent;
+    n->hash = h;
+    n->next = edge_table[h & (edge_buckets - 1)];
+    edge_table[h & (edge_buckets - 1)] = n;
+    parent->nchild++;
+    if (++edge_count > edge_buckets) edge_table_grow();
+    return n;
+}
+
+static TNode *trie_wild_child(TNode *parent, int rest) {
+    TNode **slot = rest ? &parent->rest : &parent->star;
+    if (!*slot) {
+        *slot = calloc(1, sizeof(TNode) + 2);
+        if (!*slot) return NULL;
+        (*slot)->parent = parent;
+        (*slot)->seg[0] = rest ? '#' : '*';
+    }
+    return *slot;
+}
+
+// Busca (o crea) el nodo de un patrón. Devuelve NULL si el patrón es inválido.
+static TNode *trie_lookup(const char *pattern, int create) {
+    TNode *n = &trie_root;
+    const char *p = pattern;
+    for (;;) {
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len == 1 && p[0] == '#') {
+            if (end) return NULL;          // '#' sólo al final
+            return create ? trie_wild_child(n, 1) : n->rest;
+        }
+        if (len == 1 && p[0] == '*') n = create ? trie_wild_child(n, 0) : n->star;
+        else if (memchr(p, '*', len) || memchr(p, '#', len)) return NULL; // comodín parcial
+        else n = trie_child(n, p, len, create);
+        if (!n) return NULL;
+        if (!end) return n;
+        p = end + 1;
+    }
+}
+
+// Libera nodos vacíos subiendo hacia la raíz.
+static void trie_prune(TNode *n) {
+    while (n != &trie_root && n->subs.n == 0 && n->nchild == 0 && !n->star && !n->rest) {
+        TNode *parent = n->parent;
+        if (parent->star == n) parent->star = NULL;
+        else if (parent->rest == n) parent->rest = NULL;
+        else {
+            TNode **pp = &edge_table[n->hash & (edge_buckets - 1)];
+            while (*pp && *pp != n) pp = &(*pp)->next;
+            if (*pp) *pp = n->next;
+            --edge_count;
+            parent->nchild--;
+        }
+        free(n->subs.v);
+        free(n);
+        n = parent;
+    }
+}
+
+static int is_pattern(const char *name) {
+    return strchr(name, '*') || strchr(name, '#');
+}
+
+static SubList *sub_list(const Sub *s) {
+    return s->topic ? &s->topic->subs : &s->node->subs;
+}
+
+static SubEntry *sub_entry(const Sub *s) {
+    return &sub_list(s)->v[s->pos];
+}
+
+// Busca la suscripción del cliente a ese tema/nodo; -1 si no existe.
+static int client_find_sub(int fd, const Topic *t, const TNode *n) {
+    for (int i = 0; i < clients[fd].nsubs; ++i)
+        if (clients[fd].subs[i].topic == t && clients[fd].subs[i].node == n) return i;
+    return -1;
+}
+
+// Agrega la suscripción del cliente a un tema exacto (t) o a un nodo del trie (n).
+static int client_add_sub(int fd, Topic *t, TNode *n) {
+    Client *c = &clients[fd];
+    if (c->nsubs >= MAX_SUBS_PER_CLIENT) return -1;
+    if (c->nsubs == c->cap) {
+        int ncap = c->cap ? c->cap * 2 : 4;
+        Sub *ns = realloc(c->subs, (size_t)ncap * sizeof(Sub));
+        if (!ns) return -1;
+        c->subs = ns;
+        c->cap = ncap;
+    }
+    Sub s = { t, n, 0 };
+    SubList *l = sub_list(&s);
+    if (l->n == l->cap) {
+        int ncap = l->cap ? l->cap * 2 : 4;
+        SubEntry *nv = realloc(l->v, (size_t)ncap * sizeof(SubEntry));
+        if (!nv) return -1;
+        l->v = nv;
+        l->cap = ncap;
+    }
+    s.pos = l->n;
+    l->v[l->n].fd = fd;
+    l->v[l->n].slot = c->nsubs;
+    l->v[l->n].from = 0;
+    l->n++;
+    c->subs[c->nsubs++] = s;
+    atomic_fetch_add_explicit(&self->nsubs, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Quita la suscripción 'slot' del cliente. En ambos arreglos el último ocupa el hueco
+// (swap-remove) y se corrige la referencia cruzada del elemento movido.
+static void client_remove_sub(int fd, int slot) {
+    Client *c = &clients[fd];
+    Sub s = c->subs[slot];
+    SubList *l = sub_list(&s);
+
+    SubEntry last = l->v[--l->n];
+    if (s.pos != l->n) {
+        l->v[s.pos] = last;
+        clients[last.fd].subs[last.slot].pos = s.pos;
+    }
+
+    Sub moved = c->subs[--c->nsubs];
+    if (slot != c->nsubs) {
+        c->subs[slot] = moved;
+        sub_list(&moved)->v[moved.pos].slot = slot;
+    }
+
+    if (s.topic && s.topic->subs.n == 0) topic_free(s.topic);
+    if (s.node) trie_prune(s.node);
+    atomic_fetch_sub_explicit(&self->nsubs, 1, memory_order_relaxed);
+}
+
+static void client_unsubscribe_all(int fd) {
+    while (clients[fd].nsubs > 0) client_remove_sub(fd, clients[fd].nsubs - 1);
+    free(clients[fd].subs);
+    clients[fd].subs = NULL;
+    clients[fd].cap = 0;
+}
+
+
+// Reserva un bloque con 'len' bytes de datos; si data != NULL se copian.
+static Msg *msg_new(const char *data, size_t len) {
+    Msg *m = malloc(sizeof(Msg) + len);
+    if (!m) return NULL;
+    atomic_init(&m->refs, 1);
+    m->len = len;
+    m->frame_len = 0;
+    m->text = m->data;
+    m->text_len = len;
+    m->topic = NULL;
+    m->offset = 0;
+    m->retain = 0;
+    if (data) memcpy(m->data, data, len);
+    return m;
+}
+
+// Bloque de una publicación (ver el esquema en Msg): una sola copia del payload.
+static Msg *msg_publish(const char *topic, size_t tlen, const char *payload, size_t plen) {
+    size_t frame = sizeof(BinHeader) + tlen + plen;
+    Msg *m = msg_new(NULL, frame + 1 + tlen + 1);
+    if (!m) return NULL;
+    BinHeader h;
+    h.op = BIN_MSG;
+    h.flags = 0;
+    h.topic_len = htons((uint16_t)tlen);
+    h.payload_len = htonl((uint32_t)plen);
+    char *p = m->data;
+    memcpy(p, &h, sizeof(h));          p += sizeof(h);
+    memcpy(p, topic, tlen);            p += tlen;
+    memcpy(p, payload, plen);          p += plen;
+    *p++ = '\n';
+    memcpy(p, topic, tlen);
+    p[tlen] = '\0';
+    m->frame_len = frame;
+    m->text = m->data + sizeof(h) + tlen;
+    m->text_len = plen + 1;
+    m->topic = p;
+    return m;
+}
+
+static Msg *msg_ref(Msg *m) {
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+    return m;
+}
+
+static void msg_unref(Msg *m) {
+    if (m && atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1) free(m);
+}
+
+// Libera todo lo que haya en la cola de salida del cliente.
+static void outq_clear(Client *c) {
+    for (int i = 0; i < c->out_count; ++i)
+        msg_unref(c->outq[(c->out_head + i) % outq_len].m);
+    free(c->outq);
+    c->outq = NULL;
+    c->out_head = c->out_count = 0;
+    c->out_off = 0;
+}
+
+static void catchup_end(int fd, int deliver);
 
 // //Como hay clientes limitados, cada vez que uno se descontecta o genera error, hay que borrarlo
 // static → solo es visible dentro del mismo archivo.
-// i → índice del cliente dentro del arreglo global clients[].
-// fd_set *allset → conjunto de descriptores de archivo (sockets) que select() está vigilando.
-// int *maxfd → puntero al valor del descriptor más alto en uso (necesario para select()).
+// fd → descriptor del cliente, que también es su índice en clients[].
+// close() saca automáticamente el fd de la instancia epoll.
+
+static void remove_client(int fd) {
+    if (clients[fd].fd >= 0) {
+        if (clients[fd].catchup) catchup_end(fd, 0);
+        client_unsubscribe_all(fd);
+        free(clients[fd].in);
+        clients[fd].in = NULL;
+        clients[fd].in_len = clients[fd].in_cap = 0;
+        outq_clear(&clients[fd]);
+        free(clients[fd].replay);
+        clients[fd].replay = NULL;
+        close(fd);
+        clients[fd].fd = -1;
+        clients[fd].role = ROLE_UNKNOWN;
+    }
+}
+
+// Marca al cliente para cerrarlo al final de la vuelta del loop (ver reap_clients()).
+static void client_kill(int fd) {
+    Client *c = &clients[fd];
+    if (c->fd < 0 || c->dead) return;
+    if (reap_n == reap_cap) {
+        int ncap = reap_cap ? reap_cap * 2 : 64;
+        int *nr = realloc(reap_fds, (size_t)ncap * sizeof(int));
+        if (!nr) { remove_client(fd); return; }
+        reap_fds = nr;
+        reap_cap = ncap;
+    }
+    c->dead = 1;
+    reap_fds[reap_n++] = fd;
+}
+
+static void reap_clients(void) {
+    for (int i = 0; i < reap_n; ++i)
+        if (clients[reap_fds[i]].dead) remove_client(reap_fds[i]);
+    reap_n = 0;
+}
+
+// Envía lo que se pueda de la cola con writev() hasta vaciarla o hasta EAGAIN.
+// Se llama cuando epoll avisa EPOLLOUT (el socket volvió a tener espacio).
+static void flush_client(int fd) {
+    Client *c = &clients[fd];
+    while (c->out_count > 0 && !c->dead) {
+        struct iovec iov[FLUSH_IOV];
+        int n = 0;
+        for (; n < FLUSH_IOV && n < c->out_count; ++n) {
+            OutMsg *m = &c->outq[(c->out_head + n) % outq_len];
+            size_t off = (n == 0) ? c->out_off : 0;
+            iov[n].iov_base = (char*)m->data + off;
+            iov[n].iov_len  = m->len - off;
+        }
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) client_kill(fd);
+            return;
+        }
+        // Sacar de la cola los mensajes que se enviaron completos.
+        size_t left = (size_t)w;
+        while (c->out_count > 0) {
+            OutMsg *m = &c->outq[c->out_head];
+            size_t rem = m->len - c->out_off;
+            if (left < rem) { c->out_off += left; break; }
+            left -= rem;
+            msg_unref(m->m);
+            c->out_head = (c->out_head + 1) % outq_len;
+            c->out_count--;
+            c->out_off = 0;
+        }
+        if (c->out_count > 0 && c->out_off > 0) return; // envío parcial: el socket está lleno
+    }
+}
+
+// Encola una referencia al bloque para el cliente aplicando la política de desborde.
+// 'sent' es cuántos bytes ya salieron por el envío directo (sólo si la cola estaba vacía).
+// La cola se queda con la referencia que se le pasa (el llamador ya hizo msg_ref()).
+// data/len es el tramo del bloque que se envía a este cliente.
+static void outq_push(int fd, Msg *msg, const char *data, size_t len, size_t sent) {
+    Client *c = &clients[fd];
+    if (!c->outq) {
+        c->outq = malloc((size_t)outq_len * sizeof(OutMsg));
+        if (!c->outq) { msg_unref(msg); client_kill(fd); return; }
+    }
+    if (c->out_count == outq_len) {
+        if (overflow_policy == OVERFLOW_DISCONNECT) {
+            fprintf(stdout, "[Broker] fd=%d cola llena, se desconecta\n", fd);
+            msg_unref(msg);
+            client_kill(fd);
+            return;
+        }
+        // DROP_OLDEST: se descarta el más antiguo que no se haya empezado a enviar
+        // (el de la cabeza puede ir a medias y cortarlo rompería el flujo de líneas).
+        int victim = (c->out_off > 0) ? 1 : 0;
+        if (overflow_policy == OVERFLOW_DROP_NEWEST || victim >= c->out_count) {
+            msg_unref(msg);
+            return;
+        }
+        int vi = (c->out_head + victim) % outq_len;
+        msg_unref(c->outq[vi].m);
+        if (victim == 1) {
+            // Correr la cabeza un lugar para tapar el hueco del segundo.
+            c->outq[vi] = c->outq[c->out_head];
+        }
+        c->out_head = (c->out_head + 1) % outq_len;
+        c->out_count--;
+    }
+    OutMsg *o = &c->outq[(c->out_head + c->out_count) % outq_len];
+    o->m = msg;
+    o->data = data;
+    o->len = len;
+    if (c->out_count == 0) c->out_off = sent;
+    c->out_count++;
+}
+
+// Envío no bloqueante a un cliente. Si la cola está vacía se intenta send() directo;
+// lo que no quepa en el socket se encola y se termina de enviar en flush_client().
+// Con msg != NULL la cola comparte ese bloque; con NULL se copia data sólo si hace falta encolar.
+static void client_send(int fd, const char *data, size_t len, Msg *msg) {
+    Client *c = &clients[fd];
+    if (c->fd < 0 || c->dead) return;
+    size_t sent = 0;
+    if (c->out_count == 0) {
+        ssize_t w;
+        do w = send(fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        while (w < 0 && errno == EINTR);
+        if (w == (ssize_t)len) return;
+        if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK) { client_kill(fd); return; }
+        if (w > 0) sent = (size_t)w;
+    }
+    if (msg) {
+        msg_ref(msg);
+    } else {
+        msg = msg_new(data, len);
+        if (!msg) { client_kill(fd); return; }
+        data = msg->data;
+    }
+    outq_push(fd, msg, data, len, sent);
+}
+
+static void reply(int fd, const char *text) {
+    client_send(fd, text, strlen(text), NULL);
+}
+
+// Respuesta de estado: en texto es la línea tal cual; en binario un frame BIN_OK/BIN_ERR
+// con el tema y la misma línea (sin '\n') como payload.
+static void reply_status(int fd, int ok, const char *name, const char *line) {
+    if (!clients[fd].binary) {
+        reply(fd, line);
+        return;
+    }
+    size_t tlen = name ? strlen(name) : 0;
+    size_t plen = strlen(line);
+    if (plen && line[plen-1] == '\n') --plen;
+    char frame[sizeof(BinHeader) + TOPIC_SIZE + 256];
+    if (tlen >= TOPIC_SIZE) tlen = 0;
+    if (plen > 256) plen = 256;
+    BinHeader h;
+    h.op = ok ? BIN_OK : BIN_ERR;
+    h.flags = 0;
+    h.topic_len = htons((uint16_t)tlen);
+    h.payload_len = htonl((uint32_t)plen);
+    memcpy(frame, &h, sizeof(h));
+    memcpy(frame + sizeof(h), name, tlen);
+    memcpy(frame + sizeof(h) + tlen, line, plen);
+    client_send(fd, frame, sizeof(h) + tlen + plen, NULL);
+}
+
+// Encola una publicación en el formato del cliente (frame binario o línea de texto).
+static void client_send_msg(int fd, Msg *msg) {
+    if (clients[fd].binary) client_send(fd, msg->data, msg->frame_len, msg);
+    else                    client_send(fd, msg->text, msg->text_len, msg);
+}
+
+static void catchup_hold(int fd, Msg *msg);
 
-static void remove_client(int i, fd_set *allset, int *maxfd) {
-    if (clients[i].fd >= 0) {
-        close(clients[i].fd);
-        clients[i].fd = -1;
-        clients[i].role = ROLE_UNKNOWN;
-        clients[i].topic[0] = '\0';
+// Envía a cada suscriptor de la lista que todavía no recibió esta publicación.
+static void deliver_list(const SubList *l, Msg *msg) {
+    for (int i = 0; i < l->n; ++i) {
+        if (msg->offset < l->v[i].from) continue;   // le llega (o le llegó) desde el log
+        Client *c = &clients[l->v[i].fd];
+        if (c->last_pub == pub_counter) continue;
+        c->last_pub = pub_counter;
+        if (c->catchup && c->subs[l->v[i].slot].topic == c->catchup) catchup_hold(c->fd, msg);
+        else client_send_msg(c->fd, msg);
     }
-    // recalcular maxfd
-    *maxfd = -1;
-    for (int k = 0; k < MAX_CLIENTS; ++k)
-        if (clients[k].fd > *maxfd) *maxfd = clients[k].fd;
+}
+
+// Recorre el trie con los niveles del tema publicado: el hijo literal, el '*' y el '#'.
+static void trie_match(const TNode *n, const char *level, Msg *msg) {
+    if (n->rest) deliver_list(&n->rest->subs, msg);
+    if (!level) {
+        deliver_list(&n->subs, msg);
+        return;
+    }
+    const char *end = strchr(level, '/');
+    size_t seg = end ? (size_t)(end - level) : strlen(level);
+    const char *next = end ? end + 1 : NULL;
+
+    const TNode *child = trie_child((TNode*)n, level, seg, 0);
+    if (child) trie_match(child, next, msg);
+    if (n->star) trie_match(n->star, next, msg);
 }
 
 //const char *topic → nombre del tema al que pertenece el mensaje.
-//const char *msg → el mensaje que se quiere enviar a todos los clientes suscritos a ese topic.
+//Msg *msg → el bloque del mensaje que se quiere enviar a todos los clientes suscritos a ese topic.
+
+// Envía a los suscriptores exactos del tema (tabla hash) y a los de los patrones
+// que coinciden (trie). Un cliente que coincide varias veces recibe el mensaje una sola vez.
+static void broadcast_to_topic(const char *topic, Msg *msg) {
+    ++pub_counter;
+    Topic *t = topic_lookup(topic, strlen(topic), 0);
+    if (t) deliver_list(&t->subs, msg);
+    if (trie_root.nchild || trie_root.star || trie_root.rest)
+        trie_match(&trie_root, topic, msg);
+}
+
+// ====== Valores retenidos (RETAIN) ======
+// Por tema se guarda el bloque de su último RETAIN (el mismo que se difundió, sin copiar) y
+// se le manda a cada suscripción nueva después de "OK SUBSCRIBED". Un RETAIN vacío lo borra.
+
+// Guarda m como último valor de su tema (o lo borra si el payload está vacío).
+static void retain_store(Msg *m) {
+    uint32_t h = djb2_hash_n(m->topic, strlen(m->topic));
+    int keep = m->text_len > 1;   // text incluye el '\n'
+    Msg *old = NULL;
+    pthread_mutex_lock(&retain_lock);
+    Retained **pp = NULL;
+    if (retain_buckets) {
+        for (pp = &retain_table[h & (retain_buckets - 1)]; *pp; pp = &(*pp)->next)
+            if ((*pp)->hash == h && strcmp((*pp)->msg->topic, m->topic) == 0) break;
+    }
+    if (pp && *pp) {
+        old = (*pp)->msg;
+        if (keep) {
+            (*pp)->msg = msg_ref(m);
+        } else {
+            Retained *r = *pp;
+            *pp = r->next;
+            free(r);
+            retain_count--;
+        }
+    } else if (keep) {
+        if (retain_count >= retain_buckets) {
+            size_t nb = retain_buckets ? retain_buckets * 2 : TOPIC_BUCKETS_INIT;
+            Retained **nt = calloc(nb, sizeof(*nt));
+            if (nt) {
+                for (size_t i = 0; i < retain_buckets; ++i) {
+                    for (Retained *r = retain_table[i], *nx; r; r = nx) {
+                        nx = r->next;
+                        r->next = nt[r->hash & (nb - 1)];
+                        nt[r->hash & (nb - 1)] = r;
+                    }
+                }
+                free(retain_table);
+                retain_table = nt;
+                retain_buckets = nb;
+            }
+        }
+        Retained *r = retain_buckets ? malloc(sizeof(Retained)) : NULL;
+        if (r) {
+            r->hash = h;
+            r->msg = msg_ref(m);
+            r->next = retain_table[h & (retain_buckets - 1)];
+            retain_table[h & (retain_buckets - 1)] = r;
+            retain_count++;
+        }
+    }
+    pthread_mutex_unlock(&retain_lock);
+    msg_unref(old);
+}
+
+// 1 si el tema coincide con el patrón ('*' = un nivel, '#' al final = cero o más niveles),
+// con las mismas reglas que trie_match().
+static int pattern_matches(const char *p, const char *t) {
+    for (;;) {
+        if (strcmp(p, "#") == 0) return 1;
+        const char *pe = strchr(p, '/'), *te = strchr(t, '/');
+        size_t pl = pe ? (size_t)(pe - p) : strlen(p);
+        size_t tl = te ? (size_t)(te - t) : strlen(t);
+        if (!(pl == 1 && *p == '*') && (pl != tl || memcmp(p, t, pl) != 0)) return 0;
+        if (!te) return !pe || strcmp(pe + 1, "#") == 0;
+        if (!pe) return 0;
+        p = pe + 1;
+        t = te + 1;
+    }
+}
+
+// Manda a la suscripción nueva del cliente (tema exacto t, o el patrón) los valores
+// retenidos que le corresponden. Con log, lo en vivo anterior al retenido ya es viejo: el
+// from de la suscripción lo descarta si todavía está en camino desde otro shard.
+static void retain_send(int fd, Topic *t, const char *pattern) {
+    Msg *one, **v = &one;
+    size_t n = 0, cap = 1;
+    pthread_mutex_lock(&retain_lock);
+    for (size_t i = 0; i < retain_buckets; ++i) {
+        if (t) i = djb2_hash_n(t->name, strlen(t->name)) & (retain_buckets - 1);
+        for (Retained *r = retain_table[i]; r; r = r->next) {
+            if (t ? strcmp(r->msg->topic, t->name) != 0 : !pattern_matches(pattern, r->msg->topic))
+                continue;
+            if (n == cap) {
+                Msg **nv = malloc(cap * 2 * sizeof(Msg *));
+                if (!nv) break;
+                memcpy(nv, v, n * sizeof(Msg *));
+                if (v != &one) free(v);
+                v = nv;
+                cap *= 2;
+            }
+            v[n++] = msg_ref(r->msg);
+        }
+        if (t) break;
+    }
+    pthread_mutex_unlock(&retain_lock);
+    for (size_t i = 0; i < n; ++i) {
+        client_send_msg(fd, v[i]);
+        if (t && log_dir) sub_entry(&clients[fd].subs[client_find_sub(fd, t, NULL)])->from = v[i]->offset + 1;
+        msg_unref(v[i]);
+    }
+    if (v != &one) free(v);
+}
+
+// ====== Inbox entre workers (cola MPSC intrusiva, algoritmo de Vyukov) ======
+static int inbox_init(Inbox *q) {
+    q->evfd = eventfd(0, EFD_NONBLOCK);
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+    atomic_init(&q->wake_pending, 0);
+    return q->evfd;
+}
+
+// Lado productor (cualquier hilo): un exchange atómico y un store, sin locks.
+static void inbox_push(Inbox *q, XNode *n) {
+    atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+    XNode *prev = atomic_exchange_explicit(&q->head, n, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+// Lado consumidor (sólo el hilo dueño). NULL si está vacía o si un productor
+// todavía no terminó de enlazar su nodo (se reintenta en el próximo aviso).
+static XNode *inbox_pop(Inbox *q) {
+    XNode *tail = q->tail;
+    XNode *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &q->stub) {
+        if (!next) return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) return NULL;
+    inbox_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// Avisa al consumidor por su eventfd sólo si no tiene ya un aviso pendiente.
+static void inbox_wake(Inbox *q) {
+    if (atomic_exchange_explicit(&q->wake_pending, 1, memory_order_acq_rel) == 0) {
+        uint64_t one = 1;
+        ssize_t r = write(q->evfd, &one, sizeof(one));
+        (void)r;
+    }
+}
+
+// Lado consumidor, al despertar: lee el eventfd y baja la bandera antes de vaciar, así lo
+// que llegue después genera un aviso nuevo. (exchange y no store: así se sincroniza con los
+// productores que ya vieron la bandera en 1)
+static void inbox_ack(Inbox *q) {
+    uint64_t cnt;
+    ssize_t r = read(q->evfd, &cnt, sizeof(cnt));
+    (void)r;
+    atomic_exchange_explicit(&q->wake_pending, 0, memory_order_acq_rel);
+}
+
+// ====== Log persistente: hilo escritor ======
+// Los workers le pasan cada publicación al hilo del log por su inbox (como entre shards).
+// Él agrupa por tema y escribe cada tanda con un solo writev(); el fsync es uno cada
+// --log-sync-ms para todo lo escrito en ese lapso (group commit), no uno por mensaje.
+// Los lectores (REPLAY) abren los segmentos con mmap() sin pasar por este hilo.
+
+static void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len--) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+// crc de un registro: offset, ts y payload (el largo ya se valida contra el archivo)
+static uint32_t log_crc(const LogRec *r, const char *payload, size_t len) {
+    uint32_t crc = crc32_update(0xFFFFFFFFu, &r->offset, sizeof(r->offset));
+    crc = crc32_update(crc, &r->ts_ms, sizeof(r->ts_ms));
+    return ~crc32_update(crc, payload, len);
+}
+
+static uint64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static uint64_t mono_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+// Nombre del directorio de un tema: letras, dígitos, '-' y '_' tal cual; el resto
+// (incluidos '/' y '.') como %XX.
+static void log_dirname(const char *name, char *out, size_t cap) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t o = 0;
+    for (const unsigned char *p = (const unsigned char *)name; *p && o + 4 < cap; ++p) {
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') ||
+            *p == '-' || *p == '_') {
+            out[o++] = (char)*p;
+        } else {
+            out[o++] = '%';
+            out[o++] = hex[*p >> 4];
+            out[o++] = hex[*p & 15];
+        }
+    }
+    out[o] = '\0';
+}
+
+static int log_topicname(const char *dir, char *out, size_t cap) {
+    size_t o = 0;
+    for (const char *p = dir; *p; ++p) {
+        if (o + 1 >= cap) return -1;
+        if (*p == '%') {
+            unsigned v;
+            if (sscanf(p + 1, "%2x", &v) != 1) return -1;
+            out[o++] = (char)v;
+            p += 2;
+        } else {
+            out[o++] = *p;
+        }
+    }
+    out[o] = '\0';
+    return o ? 0 : -1;
+}
+
+// Ruta de un segmento (ext = "log" o "idx"), o del directorio del tema si ext es NULL.
+static void log_path(char *out, size_t cap, const char *name, uint64_t base, const char *ext) {
+    char dir[TOPIC_SIZE * 3 + 1];
+    log_dirname(name, dir, sizeof(dir));
+    if (ext) snprintf(out, cap, "%s/%s/%020llu.%s", log_dir, dir, (unsigned long long)base, ext);
+    else     snprintf(out, cap, "%s/%s", log_dir, dir);
+}
+
+// fsync de un directorio: hace durable que se creó (o borró) un archivo adentro.
+static void fsync_dir(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+// Busca el log de un tema y opcionalmente lo crea (vacío). Se llama con log_lock tomado.
+static TopicLog *log_lookup(const char *name, int create) {
+    size_t len = strlen(name);
+    uint32_t h = djb2_hash_n(name, len);
+    if (log_buckets) {
+        for (TopicLog *lg = log_table[h & (log_buckets - 1)]; lg; lg = lg->next)
+            if (lg->hash == h && strcmp(lg->name, name) == 0) return lg;
+    }
+    if (!create) return NULL;
+    if (log_count >= log_buckets) {
+        size_t nb = log_buckets ? log_buckets * 2 : TOPIC_BUCKETS_INIT;
+        TopicLog **nt = calloc(nb, sizeof(*nt));
+        if (!nt) return NULL;
+        for (size_t i = 0; i < log_buckets; ++i) {
+            for (TopicLog *lg = log_table[i], *nx; lg; lg = nx) {
+                nx = lg->next;
+                lg->next = nt[lg->hash & (nb - 1)];
+                nt[lg->hash & (nb - 1)] = lg;
+            }
+        }
+        free(log_table);
+        log_table = nt;
+        log_buckets = nb;
+    }
+    TopicLog *lg = calloc(1, sizeof(TopicLog) + len + 1);
+    if (!lg) return NULL;
+    memcpy(lg->name, name, len + 1);
+    lg->hash = h;
+    lg->fd = lg->idx_fd = -1;
+    lg->index_pos = UINT64_MAX;
+    lg->next = log_table[h & (log_buckets - 1)];
+    log_table[h & (log_buckets - 1)] = lg;
+    log_count++;
+    return lg;
+}
+
+// Agrega un segmento al final de la lista. Con log_lock tomado.
+static int log_seg_add(TopicLog *lg, uint64_t base, uint64_t size) {
+    if (lg->nsegs == lg->segs_cap) {
+        int ncap = lg->segs_cap ? lg->segs_cap * 2 : 8;
+        LogSeg *ns = realloc(lg->segs, (size_t)ncap * sizeof(LogSeg));
+        if (!ns) return -1;
+        lg->segs = ns;
+        lg->segs_cap = ncap;
+    }
+    lg->segs[lg->nsegs].base = base;
+    lg->segs[lg->nsegs].size = size;
+    lg->nsegs++;
+    return 0;
+}
+
+// Retención: se borran los segmentos más viejos mientras el tema ocupe más de log_retain.
+// El activo nunca se borra. Un lector que ya tiene uno mapeado lo sigue leyendo bien.
+// Con log_lock tomado.
+static void log_retention(TopicLog *lg) {
+    if (!log_retain) return;
+    uint64_t total = 0;
+    for (int i = 0; i < lg->nsegs; ++i) total += lg->segs[i].size;
+    while (lg->nsegs > 1 && total > log_retain) {
+        char path[PATH_MAX];
+        log_path(path, sizeof(path), lg->name, lg->segs[0].base, "log");
+        unlink(path);
+        log_path(path, sizeof(path), lg->name, lg->segs[0].base, "idx");
+        unlink(path);
+        total -= lg->segs[0].size;
+        memmove(lg->segs, lg->segs + 1, (size_t)(lg->nsegs - 1) * sizeof(LogSeg));
+        lg->nsegs--;
+    }
+}
+
+// Abre (creándolos si hace falta) los archivos del segmento activo.
+static int log_open_active(TopicLog *lg, uint64_t base) {
+    char path[PATH_MAX];
+    log_path(path, sizeof(path), lg->name, base, "log");
+    lg->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    log_path(path, sizeof(path), lg->name, base, "idx");
+    lg->idx_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (lg->fd < 0 || lg->idx_fd < 0) {
+        perror("[Log] open");
+        if (lg->fd >= 0) close(lg->fd);
+        if (lg->idx_fd >= 0) close(lg->idx_fd);
+        lg->fd = lg->idx_fd = -1;
+        return -1;
+    }
+    log_path(path, sizeof(path), lg->name, 0, NULL);
+    fsync_dir(path);
+    return 0;
+}
+
+// Recorre el último segmento de un tema (el único que pudo quedar a medio escribir): se
+// queda con los registros válidos, corta la cola rota y rehace su índice.
+// Devuelve el offset siguiente al último registro válido.
+static uint64_t log_recover(TopicLog *lg, LogSeg *sg) {
+    char path[PATH_MAX];
+    log_path(path, sizeof(path), lg->name, sg->base, "log");
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        sg->size = 0;
+        return sg->base;
+    }
+    uint64_t size = (uint64_t)st.st_size, pos = 0, off = sg->base;
+    const char *map = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    if (map == MAP_FAILED) map = NULL;
+
+    log_path(path, sizeof(path), lg->name, sg->base, "idx");
+    int ifd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    lg->index_pos = UINT64_MAX;
+    while (map && pos + sizeof(LogRec) <= size) {
+        LogRec r;
+        memcpy(&r, map + pos, sizeof(r));
+        uint64_t len = ntohl(r.len);
+        if (pos + sizeof(r) + len > size || be64toh(r.offset) != off ||
+            log_crc(&r, map + pos + sizeof(r), len) != ntohl(r.crc))
+            break;
+        if (lg->index_pos == UINT64_MAX || pos - lg->index_pos >= LOG_INDEX_EVERY) {
+            LogIdx e = { htobe64(off), htobe64(pos) };
+            if (ifd >= 0 && write(ifd, &e, sizeof(e)) != (ssize_t)sizeof(e)) perror("[Log] idx");
+            lg->index_pos = pos;
+        }
+        pos += sizeof(r) + len;
+        off++;
+    }
+    if (map) munmap((void *)map, size);
+    if (pos < size) {
+        fprintf(stderr, "[Log] %s: %llu bytes incompletos al final de %020llu.log, se descartan\n",
+                lg->name, (unsigned long long)(size - pos), (unsigned long long)sg->base);
+        if (ftruncate(fd, (off_t)pos) < 0) perror("[Log] ftruncate");
+        fdatasync(fd);
+    }
+    if (ifd >= 0) {
+        fdatasync(ifd);
+        close(ifd);
+    }
+    close(fd);
+    sg->size = pos;
+    return off;
+}
+
+// Archivo con el último RETAIN del tema (DIR/<tema>/retained): un registro como los del log.
+static void log_retained_path(const TopicLog *lg, char *out, size_t cap, const char *suffix) {
+    char dir[TOPIC_SIZE * 3 + 1];
+    log_dirname(lg->name, dir, sizeof(dir));
+    snprintf(out, cap, "%s/%s/retained%s", log_dir, dir, suffix);
+}
+
+// Guarda el último RETAIN de la tanda: se escribe aparte y se reemplaza con rename(), así
+// al arrancar hay uno entero (el nuevo o el anterior). Uno vacío borra el archivo.
+static void log_save_retained(TopicLog *lg) {
+    Msg *m = lg->retain_pend;
+    lg->retain_pend = NULL;
+    char path[PATH_MAX], tmp[PATH_MAX];
+    log_retained_path(lg, path, sizeof(path), "");
+    log_retained_path(lg, tmp, sizeof(tmp), ".tmp");
+    size_t plen = m->text_len - 1;
+    if (plen == 0) {
+        unlink(path);
+        msg_unref(m);
+        return;
+    }
+    LogRec h;
+    h.len = htonl((uint32_t)plen);
+    h.offset = htobe64(m->offset);
+    h.ts_ms = htobe64(log_now);
+    h.crc = htonl(log_crc(&h, m->text, plen));
+    struct iovec iov[2] = { { &h, sizeof(h) }, { (void *)m->text, plen } };
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || writev(fd, iov, 2) != (ssize_t)(sizeof(h) + plen)) {
+        perror("[Log] retained");
+        if (fd >= 0) close(fd);
+        unlink(tmp);
+    } else {
+        close(fd);
+        if (rename(tmp, path) < 0) perror("[Log] rename");
+    }
+    msg_unref(m);
+}
+
+// Al arrancar: el último RETAIN guardado del tema vuelve a la tabla de retenidos.
+static void log_load_retained(TopicLog *lg) {
+    char path[PATH_MAX];
+    log_retained_path(lg, path, sizeof(path), "");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    LogRec h;
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0 && read(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) &&
+        sizeof(h) + ntohl(h.len) == (uint64_t)st.st_size && (buf = malloc(ntohl(h.len) + 1)) &&
+        read(fd, buf, ntohl(h.len)) == (ssize_t)ntohl(h.len) &&
+        log_crc(&h, buf, ntohl(h.len)) == ntohl(h.crc)) {
+        Msg *m = msg_publish(lg->name, strlen(lg->name), buf, ntohl(h.len));
+        if (m) {
+            m->offset = be64toh(h.offset);
+            m->retain = 1;
+            retain_store(m);
+            msg_unref(m);
+        }
+    }
+    free(buf);
+    close(fd);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Carga el log de un tema existente: lista sus segmentos y repara el último.
+static void log_load_topic(const char *dirname) {
+    char name[TOPIC_SIZE], path[PATH_MAX];
+    if (log_topicname(dirname, name, sizeof(name)) < 0) return;
+    snprintf(path, sizeof(path), "%s/%s", log_dir, dirname);
+    DIR *d = opendir(path);
+    if (!d) return;
+    uint64_t *bases = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        char *end;
+        unsigned long long b = strtoull(de->d_name, &end, 10);
+        if (end == de->d_name || strcmp(end, ".log") != 0) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *nb = realloc(bases, cap * sizeof(uint64_t));
+            if (!nb) break;
+            bases = nb;
+        }
+        bases[n++] = b;
+    }
+    closedir(d);
+    if (n == 0) { free(bases); return; }
+    qsort(bases, n, sizeof(uint64_t), cmp_u64);
+
+    TopicLog *lg = log_lookup(name, 1);
+    if (!lg) { free(bases); return; }
+    for (size_t i = 0; i < n; ++i) {
+        struct stat st;
+        log_path(path, sizeof(path), name, bases[i], "log");
+        if (stat(path, &st) < 0 || log_seg_add(lg, bases[i], (uint64_t)st.st_size) < 0) continue;
+    }
+    free(bases);
+    if (lg->nsegs == 0) return;
+    LogSeg *last = &lg->segs[lg->nsegs - 1];
+    lg->next_offset = lg->write_offset = lg->pub_offset = log_recover(lg, last);
+    lg->write_pos = last->size;
+    log_open_active(lg, last->base);
+    log_load_retained(lg);
+}
+
+// Log de un tema para escribir: si no existe se crea su directorio y el primer segmento.
+static TopicLog *log_for_write(const char *name) {
+    pthread_mutex_lock(&log_lock);
+    TopicLog *lg = log_lookup(name, 1);
+    if (lg && lg->nsegs == 0) {
+        char path[PATH_MAX];
+        log_path(path, sizeof(path), name, 0, NULL);
+        if ((mkdir(path, 0755) < 0 && errno != EEXIST) || log_seg_add(lg, 0, 0) < 0) {
+            perror("[Log] mkdir");
+            lg->failed = 1;
+            lg = NULL;
+        } else {
+            fsync_dir(log_dir);
+            log_open_active(lg, 0);
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+    return lg;
+}
+
+// El tema deja de registrarse hasta reiniciar (al arrancar se repara la cola). Con failed,
+// quien se está poniendo al día desde este log no espera lo que ya no se va a escribir.
+static void log_fail(TopicLog *lg) {
+    if (lg->fd >= 0) close(lg->fd);
+    if (lg->idx_fd >= 0) close(lg->idx_fd);
+    lg->fd = lg->idx_fd = -1;
+    pthread_mutex_lock(&log_lock);
+    lg->failed = 1;
+    pthread_mutex_unlock(&log_lock);
+}
+
+// Escribe la tanda pendiente de un tema con un writev() (más el índice) y la hace visible.
+static void log_flush(TopicLog *lg) {
+    if (lg->npend == 0) return;
+    struct iovec *iov = lg->iov;
+    int cnt = lg->npend * 2;
+    int ok = lg->fd >= 0;
+    while (ok && cnt > 0) {
+        ssize_t w = writev(lg->fd, iov, cnt);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            perror("[Log] writev");
+            ok = 0;
+            break;
+        }
+        // Escritura parcial: se sigue desde donde quedó
+        while (cnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    if (ok && lg->nidx) {
+        size_t bytes = (size_t)lg->nidx * sizeof(LogIdx);
+        if (write(lg->idx_fd, lg->idx, bytes) != (ssize_t)bytes) perror("[Log] idx");
+    }
+    if (ok) {
+        pthread_mutex_lock(&log_lock);
+        lg->segs[lg->nsegs - 1].size = lg->write_pos;
+        lg->next_offset = lg->write_offset;
+        pthread_mutex_unlock(&log_lock);
+        if (!lg->unsynced) {
+            lg->unsynced = 1;
+            lg->sync_next = log_unsynced;
+            log_unsynced = lg;
+        }
+    } else {
+        log_fail(lg);   // el segmento quedó en un estado desconocido
+    }
+    for (int i = 0; i < lg->npend; ++i) msg_unref(lg->held[i]);
+    lg->npend = lg->nidx = 0;
+}
+
+// Cierra el segmento activo (durable) y abre uno nuevo que empieza en write_offset.
+static void log_roll(TopicLog *lg) {
+    if (lg->fd >= 0) {
+        fdatasync(lg->fd);
+        fdatasync(lg->idx_fd);
+        close(lg->fd);
+        close(lg->idx_fd);
+        lg->fd = lg->idx_fd = -1;
+    }
+    pthread_mutex_lock(&log_lock);
+    if (log_seg_add(lg, lg->write_offset, 0) == 0) {
+        log_retention(lg);
+        log_open_active(lg, lg->write_offset);
+    }
+    pthread_mutex_unlock(&log_lock);
+    lg->write_pos = 0;
+    lg->index_pos = UINT64_MAX;
+}
+
+// Agrega una publicación a la tanda de su tema. La tanda se queda con la referencia.
+static void log_append(TopicLog *lg, Msg *m) {
+    const char *payload = m->text;
+    size_t plen = m->text_len - 1;   // sin el '\n' del modo texto
+    size_t rec = sizeof(LogRec) + plen;
+    if (!lg->iov) {
+        lg->iov = malloc(LOG_BATCH * 2 * sizeof(struct iovec));
+        lg->hdr = malloc(LOG_BATCH * sizeof(LogRec));
+        lg->held = malloc(LOG_BATCH * sizeof(Msg *));
+        lg->idx = malloc(LOG_BATCH * sizeof(LogIdx));
+        if (!lg->iov || !lg->hdr || !lg->held || !lg->idx) {
+            free(lg->iov); free(lg->hdr); free(lg->held); free(lg->idx);
+            lg->iov = NULL;
+            log_fail(lg);   // saltear el registro correría los offsets de los siguientes
+            msg_unref(m);
+            return;
+        }
+    }
+    if (lg->write_pos > 0 && lg->write_pos + rec > log_segment) {
+        log_flush(lg);
+        log_roll(lg);
+    }
+    if (lg->fd < 0) {
+        if (!lg->failed) log_fail(lg);
+        msg_unref(m);
+        return;
+    }
+    if (lg->npend == LOG_BATCH) log_flush(lg);
+
+    if (lg->index_pos == UINT64_MAX || lg->write_pos - lg->index_pos >= LOG_INDEX_EVERY) {
+        lg->idx[lg->nidx].offset = htobe64(lg->write_offset);
+        lg->idx[lg->nidx].pos = htobe64(lg->write_pos);
+        lg->nidx++;
+        lg->index_pos = lg->write_pos;
+    }
+    LogRec *h = &lg->hdr[lg->npend];
+    h->len = htonl((uint32_t)plen);
+    h->offset = htobe64(lg->write_offset);
+    h->ts_ms = htobe64(log_now);
+    h->crc = htonl(log_crc(h, payload, plen));
+    lg->iov[lg->npend * 2].iov_base = h;
+    lg->iov[lg->npend * 2].iov_len = sizeof(LogRec);
+    lg->iov[lg->npend * 2 + 1].iov_base = (void *)payload;
+    lg->iov[lg->npend * 2 + 1].iov_len = plen;
+    lg->held[lg->npend++] = m;
+    lg->write_offset++;
+    lg->write_pos += rec;
+    if (m->retain) {
+        msg_unref(lg->retain_pend);
+        lg->retain_pend = msg_ref(m);
+    }
+    if (!lg->pending) {
+        lg->pending = 1;
+        lg->pend_next = log_pending;
+        log_pending = lg;
+    }
+}
+
+// Group commit: un fdatasync por tema para todo lo escrito desde el anterior.
+static void log_sync_all(void) {
+    for (TopicLog *lg = log_unsynced, *nx; lg; lg = nx) {
+        nx = lg->sync_next;
+        if (lg->fd >= 0 && fdatasync(lg->fd) < 0) perror("[Log] fdatasync");
+        lg->unsynced = 0;
+        lg->sync_next = NULL;
+    }
+    log_unsynced = NULL;
+}
+
+static void *log_run(void *arg) {
+    (void)arg;
+    uint64_t last_sync = mono_ms();
+    int more = 0;
+    for (;;) {
+        // Sin nada escrito sin fsync se espera sin límite; si no, hasta que toque el fsync.
+        int timeout = -1;
+        if (more) {
+            timeout = 0;
+        } else if (log_unsynced) {
+            uint64_t now = mono_ms();
+            timeout = now >= last_sync + (uint64_t)log_sync_ms ? 0 : (int)(last_sync + (uint64_t)log_sync_ms - now);
+        }
+        struct pollfd pfd = { log_inbox.evfd, POLLIN, 0 };
+        int r = poll(&pfd, 1, timeout);
+        if (r < 0 && errno != EINTR) perror("[Log] poll");
+
+        if (r > 0) inbox_ack(&log_inbox);
+        log_now = wall_ms();
+        XNode *n;
+        int drained = 0;
+        while (drained < LOG_DRAIN && (n = inbox_pop(&log_inbox)) != NULL) {
+            // segs sólo lo cambia este hilo: se puede mirar sin log_lock
+            TopicLog *lg = n->log;
+            if (!lg || lg->nsegs == 0) lg = log_for_write(n->msg->topic);
+            if (lg) log_append(lg, n->msg);
+            else msg_unref(n->msg);
+            free(n);
+            drained++;
+        }
+        more = drained == LOG_DRAIN;
+        for (TopicLog *lg = log_pending, *nx; lg; lg = nx) {
+            nx = lg->pend_next;
+            log_flush(lg);
+            if (lg->retain_pend) log_save_retained(lg);
+            lg->pending = 0;
+            lg->pend_next = NULL;
+        }
+        log_pending = NULL;
+
+        if (log_unsynced && mono_ms() >= last_sync + (uint64_t)log_sync_ms) {
+            log_sync_all();
+            last_sync = mono_ms();
+        }
+    }
+    return NULL;
+}
+
+// Carga los logs existentes y arranca el hilo escritor (antes que los workers).
+static void log_init(void) {
+    crc32_init();
+    if (mkdir(log_dir, 0755) < 0 && errno != EEXIST) {
+        perror(log_dir);
+        exit(1);
+    }
+    DIR *d = opendir(log_dir);
+    if (!d) { perror(log_dir); exit(1); }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+        if (de->d_name[0] != '.') log_load_topic(de->d_name);
+    closedir(d);
+    if (inbox_init(&log_inbox) < 0) { perror("eventfd"); exit(1); }
+    if (pthread_create(&log_thread, NULL, log_run, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    printf("Log persistente en %s (%zu temas)\n", log_dir, log_count);
+}
+
+// Le pasa una publicación al hilo del log (con una referencia propia) y le asigna su offset.
+// Asignar y encolar bajo el mismo lock hace que el inbox quede en orden de offset: el hilo
+// del log los escribe en ese orden y el offset que ven los suscriptores en vivo es el mismo
+// que queda en el log.
+static void log_submit(Msg *msg) {
+    XNode *n = malloc(sizeof(XNode));
+    if (!n) return;
+    n->msg = msg_ref(msg);
+    pthread_mutex_lock(&log_lock);
+    TopicLog *lg = log_lookup(msg->topic, 1);
+    if (lg) msg->offset = lg->pub_offset++;
+    n->log = lg;
+    inbox_push(&log_inbox, n);
+    pthread_mutex_unlock(&log_lock);
+    inbox_wake(&log_inbox);
+}
+
+// ====== Log persistente: reproducción (REPLAY) ======
+// Cada cliente que pidió REPLAY tiene un cursor (replay_next y el segmento/posición donde
+// quedó). Se le manda desde el log, con mmap(), mientras su cola de salida tenga lugar; el
+// resto sale cuando se vacía (EPOLLOUT). Así reproducir un log largo no desborda la cola.
+
+// Vuelve a pedir EPOLLOUT (con edge-triggered, MOD sobre un socket con espacio lo reporta).
+static void client_rearm(int fd) {
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+// Posición del último registro con offset <= off según el índice disperso del segmento.
+static uint64_t log_index_find(const char *name, uint64_t base, uint64_t off) {
+    char path[PATH_MAX];
+    log_path(path, sizeof(path), name, base, "idx");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(LogIdx)) {
+        close(fd);
+        return 0;
+    }
+    size_t n = (size_t)st.st_size / sizeof(LogIdx);
+    const LogIdx *e = mmap(NULL, n * sizeof(LogIdx), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (e == MAP_FAILED) return 0;
+    // Búsqueda binaria: el índice está ordenado por offset
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (be64toh(e[mid].offset) <= off) lo = mid + 1;
+        else hi = mid;
+    }
+    uint64_t pos = lo ? be64toh(e[lo - 1].pos) : 0;
+    munmap((void *)e, n * sizeof(LogIdx));
+    return pos;
+}
+
+// Lugar en la cola que puede ocupar la reproducción (la otra mitad queda para lo en vivo)
+static int replay_room(const Client *c) {
+    return c->out_count < (outq_len > 1 ? outq_len / 2 : 1);
+}
+
+static void replay_end(int fd) {
+    Client *c = &clients[fd];
+    char line[TOPIC_SIZE + 64];
+    snprintf(line, sizeof(line), "OK REPLAY END %s %llu\n", c->replay,
+             (unsigned long long)c->replay_next);
+    reply_status(fd, 1, c->replay, line);
+    free(c->replay);
+    c->replay = NULL;
+}
+
+// Manda registros de un segmento [base, seg_end) de 'size' bytes a partir de replay_next y
+// antes de 'limit'. Descuenta de *budget lo que mandó.
+static void replay_segment(int fd, uint64_t base, uint64_t size, uint64_t seg_end,
+                           uint64_t limit, int *budget) {
+    Client *c = &clients[fd];
+    char path[PATH_MAX];
+    log_path(path, sizeof(path), c->replay, base, "log");
+    int sfd = open(path, O_RDONLY | O_CLOEXEC);
+    const char *map = MAP_FAILED;
+    if (sfd >= 0) {
+        if (size) map = mmap(NULL, size, PROT_READ, MAP_SHARED, sfd, 0);
+        close(sfd);
+    }
+    if (map == MAP_FAILED) {
+        // Lo borró la retención (o no se puede leer): se sigue con el próximo segmento
+        c->replay_next = seg_end;
+        return;
+    }
+    uint64_t pos = (c->replay_base == base && c->replay_pos <= size) ? c->replay_pos
+                 : log_index_find(c->replay, base, c->replay_next);
+    size_t tlen = strlen(c->replay);
+    while (pos + sizeof(LogRec) <= size && *budget > 0 && replay_room(c) && !c->dead) {
+        LogRec r;
+        memcpy(&r, map + pos, sizeof(r));
+        uint64_t off = be64toh(r.offset), len = ntohl(r.len);
+        if (pos + sizeof(r) + len > size || off >= limit) break;
+        pos += sizeof(r) + len;
+        if (off < c->replay_next) continue;   // avanzando desde la entrada del índice
+        Msg *m = msg_publish(c->replay, tlen, map + pos - len, len);
+        if (!m) break;
+        client_send_msg(fd, m);
+        msg_unref(m);
+        c->replay_next = off + 1;
+        (*budget)--;
+    }
+    munmap((void *)map, size);
+    c->replay_base = base;
+    c->replay_pos = pos;
+    // Segmento leído entero: lo que falte hasta el próximo no existe (p. ej. se cortó al reparar)
+    if (pos + sizeof(LogRec) > size && c->replay_next < seg_end) c->replay_next = seg_end;
+}
+
+// ====== SUBSCRIBE ... FROM: ponerse al día desde el log y seguir en vivo ======
+// La suscripción se agrega enseguida, con from = pub_offset del tema en ese momento (P). Lo
+// anterior a P sale del log con el mismo cursor de REPLAY; lo de P en adelante que llega en
+// vivo mientras tanto se retiene en held[] y se encola recién cuando el log llegó a P. Como
+// el offset se asigna al publicar, no hay huecos ni duplicados: lo que llegue tarde en vivo
+// con offset < P ya salió del log y deliver_list() lo descarta.
+
+static SubEntry *catchup_entry(int fd) {
+    return sub_entry(&clients[fd].subs[client_find_sub(fd, clients[fd].catchup, NULL)]);
+}
+
+// Termina la puesta al día: con deliver, encola lo retenido (en el orden en que llegó).
+static void catchup_end(int fd, int deliver) {
+    Client *c = &clients[fd];
+    for (int i = 0; i < c->nheld; ++i) {
+        if (deliver) client_send_msg(fd, c->held[i]);
+        msg_unref(c->held[i]);
+    }
+    free(c->held);
+    c->held = NULL;
+    c->nheld = 0;
+    c->catchup = NULL;
+    free(c->replay);
+    c->replay = NULL;
+}
+
+// Retiene una publicación en vivo hasta que el log alcance a P. Si no entra (held[] tiene
+// lugar para una cola de salida), se suelta todo y P pasa al pub_offset actual: eso también
+// va a salir del log, que el cliente lee a su ritmo.
+static void catchup_hold(int fd, Msg *msg) {
+    Client *c = &clients[fd];
+    if (!c->held) c->held = malloc((size_t)outq_len * sizeof(Msg *));
+    if (c->held && c->nheld < outq_len) {
+        c->held[c->nheld++] = msg_ref(msg);
+        return;
+    }
+    for (int i = 0; i < c->nheld; ++i) msg_unref(c->held[i]);
+    c->nheld = 0;
+    pthread_mutex_lock(&log_lock);
+    TopicLog *lg = log_lookup(c->catchup->name, 0);
+    if (lg) catchup_entry(fd)->from = lg->pub_offset;
+    pthread_mutex_unlock(&log_lock);
+}
+
+// Offset del primer registro del tema publicado a partir de ts (ms desde epoch). Se busca
+// el segmento más nuevo que empieza antes de ts y se recorre (el índice no guarda horas).
+static uint64_t log_offset_at(const char *name, uint64_t ts) {
+    pthread_mutex_lock(&log_lock);
+    TopicLog *lg = log_lookup(name, 0);
+    int n = lg ? lg->nsegs : 0;
+    uint64_t end = lg ? lg->next_offset : 0;
+    LogSeg *segs = n ? malloc((size_t)n * sizeof(LogSeg)) : NULL;
+    if (segs) memcpy(segs, lg->segs, (size_t)n * sizeof(LogSeg));
+    pthread_mutex_unlock(&log_lock);
+    if (!segs) return end;
+
+    char path[PATH_MAX];
+    int i = n - 1;
+    for (; i > 0; --i) {
+        LogRec r;
+        log_path(path, sizeof(path), name, segs[i].base, "log");
+        int sfd = open(path, O_RDONLY | O_CLOEXEC);
+        ssize_t got = sfd >= 0 ? pread(sfd, &r, sizeof(r), 0) : -1;
+        if (sfd >= 0) close(sfd);
+        if (got == (ssize_t)sizeof(r) && be64toh(r.ts_ms) <= ts) break;
+    }
+    uint64_t found = i + 1 < n ? segs[i + 1].base : end;
+    uint64_t size = segs[i].size;
+    log_path(path, sizeof(path), name, segs[i].base, "log");
+    int sfd = open(path, O_RDONLY | O_CLOEXEC);
+    const char *map = MAP_FAILED;
+    if (sfd >= 0) {
+        if (size) map = mmap(NULL, size, PROT_READ, MAP_SHARED, sfd, 0);
+        close(sfd);
+    }
+    if (map != MAP_FAILED) {
+        for (uint64_t pos = 0; pos + sizeof(LogRec) <= size; ) {
+            LogRec r;
+            memcpy(&r, map + pos, sizeof(r));
+            uint64_t len = ntohl(r.len);
+            if (pos + sizeof(r) + len > size) break;
+            if (be64toh(r.ts_ms) >= ts) {
+                found = be64toh(r.offset);
+                break;
+            }
+            pos += sizeof(r) + len;
+        }
+        munmap((void *)map, size);
+    }
+    free(segs);
+    return found;
+}
+
+// Arranca la puesta al día de la suscripción (recién agregada) al tema t desde 'spec':
+// "earliest", "<offset>" o "@<ms>". Devuelve el offset desde el que se reproduce.
+static uint64_t catchup_start(int fd, Topic *t, const char *spec) {
+    Client *c = &clients[fd];
+    uint64_t start = 0;
+    if (spec[0] == '@') start = log_offset_at(t->name, strtoull(spec + 1, NULL, 10));
+    else if (strcmp(spec, "earliest") != 0) start = strtoull(spec, NULL, 10);
+
+    pthread_mutex_lock(&log_lock);
+    TopicLog *lg = log_lookup(t->name, 1);
+    uint64_t live = lg ? lg->pub_offset : 0;
+    uint64_t oldest = lg && lg->nsegs ? lg->segs[0].base : live;
+    pthread_mutex_unlock(&log_lock);
+    if (start < oldest) start = oldest;
+    if (start > live) start = live;
+
+    c->catchup = t;
+    catchup_entry(fd)->from = live;
+    c->replay = strdup(t->name);
+    if (!c->replay) {
+        c->catchup = NULL;
+        return live;
+    }
+    c->replay_next = start;
+    c->replay_base = UINT64_MAX;
+    c->replay_pos = 0;
+    return start;
+}
+
+// Sigue la reproducción del cliente hasta llenar media cola, agotar el cupo o terminar.
+static void replay_pump(int fd) {
+    Client *c = &clients[fd];
+    int budget = REPLAY_BATCH;
+    while (c->replay && !c->dead && replay_room(c)) {
+        if (budget <= 0) {
+            client_rearm(fd);   // sigue en la próxima vuelta del loop, después de los demás
+            return;
+        }
+        uint64_t end = 0, base = 0, size = 0, seg_end = 0;
+        int failed = 0;
+        pthread_mutex_lock(&log_lock);
+        TopicLog *lg = log_lookup(c->replay, 0);
+        if (lg) failed = lg->failed;
+        if (lg && lg->nsegs) {
+            end = lg->next_offset;
+            if (c->replay_next < lg->segs[0].base) c->replay_next = lg->segs[0].base;
+            int i = lg->nsegs - 1;
+            while (i > 0 && lg->segs[i].base > c->replay_next) i--;
+            base = lg->segs[i].base;
+            size = lg->segs[i].size;
+            seg_end = i + 1 < lg->nsegs ? lg->segs[i + 1].base : end;
+        }
+        pthread_mutex_unlock(&log_lock);
+        if (c->catchup) {
+            uint64_t live = catchup_entry(fd)->from;
+            if (c->replay_next >= live || (c->replay_next >= end && failed)) {
+                catchup_end(fd, 1);
+                return;
+            }
+            if (c->replay_next >= end) {
+                // Falta lo que el hilo del log todavía no escribió: se vuelve a mirar enseguida
+                client_rearm(fd);
+                return;
+            }
+            if (end > live) end = live;
+        } else if (c->replay_next >= end) {
+            replay_end(fd);
+            return;
+        }
+        replay_segment(fd, base, size, seg_end, end, &budget);
+    }
+}
 
-// Itera sobre todos los clientes para ver cuales estan suscritos al tema y están activos (fd >= 0), en orden:
-// Es valido, es un suscriptor y el tema coincide.
-//Envia el mensaje al suscriptor con send() y el descriptor del socket correspondiente. Vuelve a iterar().
-static void broadcast_to_topic(const char *topic, const char *msg) {
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].fd >= 0 && clients[i].role == ROLE_SUB && strcmp(clients[i].topic, topic) == 0) {
-            send(clients[i].fd, msg, strlen(msg), 0);
+// REPLAY <tema> [offset]: reproduce el log del tema desde offset (0 = desde el principio)
+// y termina con "OK REPLAY END <tema> <próximo offset>".
+static void do_replay(int idx, const char *name, uint64_t from) {
+    Client *c = &clients[idx];
+    if (!log_dir) {
+        reply_status(idx, 0, name, "ERR Log disabled\n");
+        return;
+    }
+    if (*name == '\0' || strlen(name) >= TOPIC_SIZE || is_pattern(name)) {
+        reply_status(idx, 0, name, "ERR Bad topic\n");
+        return;
+    }
+    if (c->catchup) {
+        reply_status(idx, 0, name, "ERR Replay in progress\n");
+        return;
+    }
+    free(c->replay);
+    c->replay = strdup(name);
+    if (!c->replay) return;
+    c->replay_next = from;
+    c->replay_base = UINT64_MAX;
+    c->replay_pos = 0;
+    if (c->role == ROLE_UNKNOWN) c->role = ROLE_SUB;
+    replay_pump(idx);
+}
+
+// Reparte la publicación a los suscriptores locales y la pasa a los shards que tengan
+// suscripciones (y al hilo del log, si está activo). Un RETAIN se guarda antes de difundirlo
+// (ya con su offset), así quien se suscribe después lo recibe.
+static void publish(Msg *msg) {
+    if (log_dir) log_submit(msg);
+    if (msg->retain) retain_store(msg);
+    broadcast_to_topic(msg->topic, msg);
+    for (int i = 0; i < nworkers; ++i) {
+        Worker *w = &workers[i];
+        if (w == self || atomic_load_explicit(&w->nsubs, memory_order_relaxed) == 0) continue;
+        XNode *n = malloc(sizeof(XNode));
+        if (!n) continue;
+        n->msg = msg_ref(msg);
+        inbox_push(&w->inbox, n);
+        inbox_wake(&w->inbox);
+    }
+}
+
+// Atiende el eventfd: entrega a los suscriptores locales lo que publicaron otros shards.
+static void drain_inbox(void) {
+    inbox_ack(&self->inbox);
+    XNode *n;
+    while ((n = inbox_pop(&self->inbox)) != NULL) {
+        broadcast_to_topic(n->msg->topic, n->msg);
+        msg_unref(n->msg);
+        free(n);
+    }
+}
+
+// SUBSCRIBE (texto o binario). Un cliente puede mandar varios: cada uno agrega un tema
+// o patrón (liga/*/goles, liga/#). Con from ("earliest", "<offset>" o "@<ms>", sólo temas
+// exactos y con log) primero recibe lo guardado desde esa posición y después lo en vivo;
+// "latest" o NULL es sólo lo nuevo.
+static void do_subscribe(int idx, const char *name, const char *from) {
+    char line[TOPIC_SIZE + 64];
+    if (*name == '\0' || strlen(name) >= TOPIC_SIZE) {
+        reply_status(idx, 0, NULL, "ERR Bad topic\n");
+        return;
+    }
+    if (from && (*from == '\0' || strcmp(from, "latest") == 0)) from = NULL;
+    if (from) {
+        const char *err = !log_dir ? "ERR Log disabled\n"
+                        : is_pattern(name) ? "ERR Bad topic\n"
+                        : clients[idx].replay ? "ERR Replay in progress\n" : NULL;
+        if (err) {
+            reply_status(idx, 0, name, err);
+            return;
         }
     }
+    Topic *t = NULL;
+    TNode *node = NULL;
+    if (is_pattern(name)) node = trie_lookup(name, 1);
+    else t = topic_lookup(name, strlen(name), 1);
+    if (!t && !node) {
+        reply_status(idx, 0, name, "ERR Bad pattern\n");
+        return;
+    }
+    int fresh = client_find_sub(idx, t, node) < 0;
+    if (fresh && client_add_sub(idx, t, node) < 0) {
+        if (t && t->subs.n == 0) topic_free(t);
+        if (node) trie_prune(node);
+        reply_status(idx, 0, name, "ERR Too many subscriptions\n");
+        return;
+    }
+    clients[idx].role = ROLE_SUB;
+    if (from && fresh) {
+        // "OK SUBSCRIBED <tema> FROM <offset>" y enseguida lo guardado desde ese offset
+        uint64_t start = catchup_start(idx, t, from);
+        snprintf(line, sizeof(line), "OK SUBSCRIBED %s FROM %llu\n", name, (unsigned long long)start);
+        reply_status(idx, 1, name, line);
+        fprintf(stdout, "[Broker] SUB: fd=%d topic=%s from=%llu\n", clients[idx].fd, name,
+                (unsigned long long)start);
+        replay_pump(idx);
+        return;
+    }
+    snprintf(line, sizeof(line), "OK SUBSCRIBED %s\n", name);
+    //Confirma la conexion al cliente.
+    reply_status(idx, 1, name, line);
+    if (fresh) retain_send(idx, t, name);
+    fprintf(stdout, "[Broker] SUB: fd=%d topic=%s\n", clients[idx].fd, name);
+}
+
+static void do_unsubscribe(int idx, const char *name) {
+    char line[TOPIC_SIZE + 32];
+    Topic *t = NULL;
+    TNode *node = NULL;
+    if (is_pattern(name)) node = trie_lookup(name, 0);
+    else t = topic_lookup(name, strlen(name), 0);
+    int slot = (t || node) ? client_find_sub(idx, t, node) : -1;
+    if (slot >= 0 && t && t == clients[idx].catchup) catchup_end(idx, 0);
+    if (slot >= 0) client_remove_sub(idx, slot);
+    if (clients[idx].nsubs == 0 && clients[idx].role == ROLE_SUB) clients[idx].role = ROLE_UNKNOWN;
+    snprintf(line, sizeof(line), "%s %s\n", slot >= 0 ? "OK UNSUBSCRIBED" : "ERR Not subscribed", name);
+    reply_status(idx, slot >= 0, name, line);
+}
+
+// PUBLISH / RETAIN: un único bloque compartido por todas las colas (ver msg_publish()).
+static void do_publish(int idx, const char *topic, size_t tlen, const char *payload, size_t plen,
+                       int retain) {
+    if (clients[idx].role == ROLE_UNKNOWN) clients[idx].role = ROLE_PUB;
+    Msg *out = msg_publish(topic, tlen, payload, plen);
+    if (!out) return;
+    out->retain = retain;
+    publish(out);
+    msg_unref(out);
 }
 
 //Identidica si es un publicador o un suscriptor, los crea, formatea los mensajes y los envía.
 //Ver los otros archivos de TCP para corrobarar consistencia PUBLISH y SUBSCRIBE
 static void handle_line(int idx, char *line) {
+    // idx es el fd del cliente (clients[] está indexado por fd)
     // trim \r\n
     size_t n = strlen(line);
     while (n && (line[n-1]=='\n' || line[n-1]=='\r')) line[--n]='\0';
 
-    // Si line es igual a "SUBSCRIBE", crea ese suscriptor y le asigna todos sus atributos.
     if (strncmp(line, "SUBSCRIBE ", 10) == 0) {
-        clients[idx].role = ROLE_SUB;
-        strncpy(clients[idx].topic, line + 10, TOPIC_SIZE-1);
-        clients[idx].topic[TOPIC_SIZE-1] = '\0';
-        char ok[128];
-        snprintf(ok, sizeof(ok), "OK SUBSCRIBED %s\n", clients[idx].topic);
-        //Confirma la conexion al cliente.
-        send(clients[idx].fd, ok, strlen(ok), 0);
-        fprintf(stdout, "[Broker] SUB: fd=%d topic=%s\n", clients[idx].fd, clients[idx].topic);
-
-    } else if (strncmp(line, "PUBLISH ", 8) == 0) {
+        // formato: SUBSCRIBE <topic> [FROM earliest|latest|<offset>|@<ms>]
+        char *from = strstr(line + 10, " FROM ");
+        if (from) {
+            *from = '\0';
+            from += 6;
+        }
+        do_subscribe(idx, line + 10, from);
+
+    } else if (strncmp(line, "UNSUBSCRIBE ", 12) == 0) {
+        do_unsubscribe(idx, line + 12);
+
+    } else if (strncmp(line, "PUBLISH ", 8) == 0 || strncmp(line, "RETAIN ", 7) == 0) {
         // formato: PUBLISH <topic> <message...>
-        char topic[TOPIC_SIZE] = {0};
-        const char *p = line + 8;
+        //          RETAIN <topic> <message...>  (además queda como último valor del tema)
+        int retain = line[0] == 'R';
+        const char *topic = line + (retain ? 7 : 8);
+        const char *p = topic;
         // Leer tema (token hasta espacio)
-        int tlen = 0;
-        while (*p && *p!=' ' && tlen < TOPIC_SIZE-1) topic[tlen++] = *p++;
-        topic[tlen] = '\0';
+        while (*p && *p!=' ' && p - topic < TOPIC_SIZE-1) ++p;
+        size_t tlen = (size_t)(p - topic);
         while (*p == ' ') ++p; // Saltar espacios
         const char *msg = p;
-        fprintf(stdout, "[Broker] PUB: topic=%s msg=%s\n", topic, msg);
+        fprintf(stdout, "[Broker] PUB: topic=%.*s msg=%s\n", (int)tlen, topic, msg);
         // reenviar sólo el mensaje plano
-        char out[BUF_SIZE];
-        snprintf(out, sizeof(out), "%s\n", msg);
-        broadcast_to_topic(topic, out);
+        do_publish(idx, topic, tlen, msg, strlen(msg), retain);
+
+    } else if (strncmp(line, "REPLAY ", 7) == 0) {
+        // formato: REPLAY <topic> [offset]
+        char *name = line + 7;
+        char *sp = strchr(name, ' ');
+        uint64_t from = 0;
+        if (sp) {
+            *sp = '\0';
+            from = strtoull(sp + 1, NULL, 10);
+        }
+        do_replay(idx, name, from);
+
+    } else if (strcmp(line, "HELLO BIN") == 0) {
+        // Negociación del modo binario: lo que siga en la conexión ya son frames.
+        reply(idx, "OK BIN\n");
+        clients[idx].binary = 1;
+
     } else {
         const char *err = "ERR Unknown command\n";
-        send(clients[idx].fd, err, strlen(err), 0);
+        reply(idx, err);
     }
 }
 
-int main(void) {
-    // init de clients
-    for (int i = 0; i < MAX_CLIENTS; ++i) clients[i].fd = -1;
+// Atiende un frame binario completo. topic y payload apuntan dentro del buffer de entrada.
+static void handle_frame(int idx, uint8_t op, uint8_t flags, const char *topic, size_t tlen,
+                         const char *payload, size_t plen)
+{
+    char name[TOPIC_SIZE];
+    memcpy(name, topic, tlen);
+    name[tlen] = '\0';
+
+    switch (op) {
+        case BIN_SUB: {
+            // payload opcional: la posición de inicio como en el modo texto ("earliest", ...)
+            char from[32];
+            if (plen >= sizeof(from)) plen = sizeof(from) - 1;
+            memcpy(from, payload, plen);
+            from[plen] = '\0';
+            do_subscribe(idx, name, plen ? from : NULL);
+            break;
+        }
+        case BIN_UNSUB:
+            do_unsubscribe(idx, name);
+            break;
+        case BIN_PUB:
+            do_publish(idx, name, tlen, payload, plen, (flags & BIN_F_RETAIN) != 0);
+            break;
+        case BIN_REPLAY: {
+            uint64_t from = 0;
+            if (plen == sizeof(from)) {
+                memcpy(&from, payload, sizeof(from));
+                from = be64toh(from);
+            }
+            do_replay(idx, name, from);
+            break;
+        }
+        default:
+            reply_status(idx, 0, NULL, "ERR Unknown command\n");
+            break;
+    }
+}
+
+// Pone un descriptor en modo no bloqueante (necesario con epoll en modo edge-triggered,
+// donde hay que leer/aceptar hasta recibir EAGAIN).
+static int set_nonblocking(int fd) {
+    int fl = fcntl(fd, F_GETFL, 0);
+    if (fl < 0) return -1;
+    return fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+// Sube el límite blando de descriptores al duro y reserva la tabla clients[] con ese tamaño.
+static void init_clients(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > MAX_FDS_CAP) max_clients = MAX_FDS_CAP;
+    else max_clients = (int)rl.rlim_cur;
+
+    clients = calloc((size_t)max_clients, sizeof(Client));
+    if (!clients) { perror("calloc"); exit(1); }
+    for (int i = 0; i < max_clients; ++i) clients[i].fd = -1;
+}
+
+// Con edge-triggered epoll sólo se avisa una vez por ráfaga de conexiones,
+// así que se aceptan todas las pendientes hasta que accept() devuelva EAGAIN.
+static void accept_all(int listenfd) {
+    for (;;) {
+        // Estructuras para guardar la info del cliente que se conecta.
+        struct sockaddr_in cli;  //IPv4 del cliente
+        socklen_t clilen = sizeof(cli);
+        int connfd = accept(listenfd, (struct sockaddr*)&cli, &clilen);
+        if (connfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        if (connfd >= max_clients) {
+            const char *full = "ERR Server full\n";
+            send(connfd, full, strlen(full), MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(connfd);
+            continue;
+        }
+
+        // El socket del cliente es no bloqueante: un suscriptor lento nunca frena el loop.
+        set_nonblocking(connfd);
+
+        // EPOLLET: sólo se notifica cuando llegan datos nuevos, no mientras queden sin leer.
+        // EPOLLOUT avisa cuando el socket vuelve a tener espacio para vaciar la cola de salida.
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = connfd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(connfd);
+            continue;
+        }
+        clients[connfd].fd = connfd;
+        clients[connfd].role = ROLE_UNKNOWN;
+        clients[connfd].nsubs = 0;
+        clients[connfd].last_pub = 0;
+        clients[connfd].dead = 0;
+        clients[connfd].binary = 0;
+        clients[connfd].replay = NULL;
+    }
+}
+
+// Asegura al menos 'need' bytes libres en el buffer de entrada del cliente.
+static int in_reserve(Client *c, size_t need) {
+    if (c->in_cap - c->in_len >= need) return 0;
+    size_t ncap = c->in_cap ? c->in_cap : BUF_SIZE;
+    while (ncap - c->in_len < need) ncap *= 2;
+    if (ncap > IN_BUF_MAX) ncap = IN_BUF_MAX;
+    if (ncap - c->in_len < need) return -1;
+    char *nb = realloc(c->in, ncap);
+    if (!nb) return -1;
+    c->in = nb;
+    c->in_cap = ncap;
+    return 0;
+}
+
+// Procesa todas las líneas completas de buf[0..len) en el mismo lugar (sin copiarlas):
+// el '\n' se reemplaza por '\0' y handle_line() recibe un puntero dentro del buffer.
+// 'from' indica desde dónde buscar el primer '\n' (lo anterior ya se sabe que no tiene).
+// Devuelve cuántos bytes consumió; lo que queda es una línea incompleta.
+static size_t parse_lines(int fd, char *buf, size_t len, size_t from) {
+    size_t start = 0;
+    char *nl;
+    while (clients[fd].fd >= 0 && !clients[fd].dead && !clients[fd].binary && (nl = memchr(buf + from, '\n', len - from)) != NULL) {
+        *nl = '\0';
+        if (nl > buf + start) handle_line(fd, buf + start);
+        start = from = (size_t)(nl - buf) + 1;
+    }
+    return start;
+}
+
+// Igual que parse_lines() pero con frames binarios: el encabezado dice cuánto mide el frame,
+// así que no hay que recorrer el payload. Devuelve los bytes consumidos.
+static size_t parse_frames(int fd, char *buf, size_t len) {
+    size_t used = 0;
+    while (clients[fd].fd >= 0 && !clients[fd].dead && len - used >= sizeof(BinHeader)) {
+        BinHeader h;
+        memcpy(&h, buf + used, sizeof(h));
+        size_t tlen = ntohs(h.topic_len);
+        size_t plen = ntohl(h.payload_len);
+        if (tlen >= TOPIC_SIZE || plen > IN_BUF_MAX - sizeof(h) - TOPIC_SIZE) {
+            reply_status(fd, 0, NULL, "ERR Frame too long\n");
+            client_kill(fd);
+            return used;
+        }
+        size_t total = sizeof(h) + tlen + plen;
+        if (len - used < total) break;
+        const char *topic = buf + used + sizeof(h);
+        handle_frame(fd, h.op, h.flags, topic, tlen, topic + tlen, plen);
+        used += total;
+    }
+    return used;
+}
 
+// Lee todo lo disponible en el socket del cliente (hasta EAGAIN) y procesa las líneas (o frames).
+// Si el cliente no tiene nada pendiente se lee en 'scratch' (compartido) y sólo el pedazo
+// final incompleto se guarda en su buffer propio; así un suscriptor inactivo no ocupa memoria
+// y un publicador puede mandar miles de PUBLISH en una sola lectura.
+static void read_client(int fd, char *scratch, size_t scratch_cap) {
+    for (;;) {
+        Client *c = &clients[fd];
+        char  *dst;
+        size_t cap;
+        if (c->in_len == 0) {
+            dst = scratch;
+            cap = scratch_cap;
+        } else {
+            size_t room = IN_BUF_MAX - c->in_len;
+            if (room == 0 || in_reserve(c, room < IN_READ_MIN ? room : IN_READ_MIN) < 0) {
+                reply_status(fd, 0, NULL, "ERR Line too long\n");
+                flush_client(fd);
+                remove_client(fd);
+                return;
+            }
+            dst = c->in + c->in_len;
+            cap = c->in_cap - c->in_len;
+        }
+
+        ssize_t n = recv(fd, dst, cap, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            //Error o cierre, toca eliminar el cliente.
+            remove_client(fd);
+            return;
+        }
+
+        // procesar por líneas (pueden venir varias, y la última puede estar incompleta)
+        char  *base = (dst == scratch) ? scratch : c->in;
+        size_t old  = (dst == scratch) ? 0 : c->in_len;
+        size_t len  = old + (size_t)n;
+        size_t used = 0;
+        if (!c->binary) used = parse_lines(fd, base, len, old);
+        // Si en esta lectura llegó "HELLO BIN", lo que sigue ya se interpreta como frames.
+        if (c->binary && c->fd >= 0 && !c->dead) used += parse_frames(fd, base + used, len - used);
+        if (clients[fd].fd < 0 || clients[fd].dead) return;
+
+        size_t tail = len - used;
+        if (base == scratch) {
+            if (tail > 0) {
+                if (in_reserve(c, tail) < 0) { remove_client(fd); return; }
+                memcpy(c->in, scratch + used, tail);
+            }
+        } else if (used > 0) {
+            memmove(c->in, c->in + used, tail);
+        }
+        c->in_len = tail;
+
+        // Sin línea pendiente, un buffer que creció por una ráfaga se devuelve.
+        if (tail == 0 && c->in_cap > BUF_SIZE) {
+            free(c->in);
+            c->in = NULL;
+            c->in_cap = 0;
+        }
+    }
+}
+
+// Opciones: --queue=N (mensajes en cola por suscriptor)
+//           --policy=drop-oldest|drop-newest|disconnect (qué hacer con la cola llena)
+//           --workers=N|auto (hilos con su propio epoll; auto = uno por núcleo)
+//           --log-dir=DIR (log persistente por tema), --log-segment=BYTES, --log-sync-ms=N,
+//           --log-retain=BYTES (por tema; 0 = todo)
+static void parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--workers=auto") == 0) {
+            nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+            nworkers = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--queue=", 8) == 0) {
+            outq_len = atoi(argv[i] + 8);
+            if (outq_len < 1) outq_len = 1;
+        } else if (strcmp(argv[i], "--policy=drop-oldest") == 0) {
+            overflow_policy = OVERFLOW_DROP_OLDEST;
+        } else if (strcmp(argv[i], "--policy=drop-newest") == 0) {
+            overflow_policy = OVERFLOW_DROP_NEWEST;
+        } else if (strcmp(argv[i], "--policy=disconnect") == 0) {
+            overflow_policy = OVERFLOW_DISCONNECT;
+        } else if (strncmp(argv[i], "--log-dir=", 10) == 0 && argv[i][10]) {
+            log_dir = argv[i] + 10;
+        } else if (strncmp(argv[i], "--log-segment=", 14) == 0) {
+            log_segment = strtoull(argv[i] + 14, NULL, 10);
+            if (log_segment < LOG_INDEX_EVERY) log_segment = LOG_INDEX_EVERY;
+        } else if (strncmp(argv[i], "--log-sync-ms=", 14) == 0) {
+            log_sync_ms = atoi(argv[i] + 14);
+            if (log_sync_ms < 0) log_sync_ms = 0;
+        } else if (strncmp(argv[i], "--log-retain=", 13) == 0) {
+            log_retain = strtoull(argv[i] + 13, NULL, 10);
+        } else {
+            fprintf(stderr, "uso: %s [--workers=N|auto] [--queue=N] [--policy=drop-oldest|drop-newest|disconnect]\n"
+                            "          [--log-dir=DIR] [--log-segment=BYTES] [--log-sync-ms=N] [--log-retain=BYTES]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+}
+
+// Crea el socket de escucha de un worker.
+static int open_listener(void) {
     //Se crea el socket TCP.
     int listenfd = socket(AF_INET, SOCK_STREAM, 0);
     if (listenfd < 0) { 
-        perror("socket"); exit(1); 
+        perror("socket"); return -1; 
     }
 
     // Habilita la reutilización del puerto/dirección para el socket de escucha.
@@ -134,6 +2351,10 @@ int main(void) {
     int yes = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
 
+    // SO_REUSEPORT: cada worker abre su propio socket en el mismo puerto y el kernel
+    // reparte las conexiones nuevas entre ellos (sin un accept() compartido que contender).
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+
 
     // Se repite la misma estructura que en los otros archivos TCP, en este caso la IP debe ser la misma donde corre el broker.
     struct sockaddr_in srv = {0};
@@ -144,124 +2365,135 @@ int main(void) {
     // bind(): asocia el socket a una dirección local (IP, puerto).
     // Reserva ip_port para que el kernel sepa a donde van los datos entrantes.
     if (bind(listenfd, (struct sockaddr*)&srv, sizeof(srv)) < 0) { 
-        perror("bind"); exit(1); 
+        perror("bind"); close(listenfd); return -1; 
     }
 
-    if (listen(listenfd, 64) < 0) { 
-        perror("listen"); exit(1); 
+    // SOMAXCONN: cola de conexiones pendientes lo más grande que permita el kernel.
+    if (listen(listenfd, SOMAXCONN) < 0) { 
+        perror("listen"); close(listenfd); return -1; 
     }
+    set_nonblocking(listenfd);
+    return listenfd;
 
-    //Declarar 2 conjuntos de descriptores de archivo (fd_set).
-    // allset → conjunto maestro que mantiene todos los fds activos (escucha + clientes
-    // rset  → conjunto temporal que se pasa a select() cada vez (porque select() lo modifica).
-    fd_set allset, rset;
-    
-    //Ninguna conexión aceptada aún.
-    FD_ZERO(&allset);
+}
 
-    // Agrega el fd del socket de escucha (listenfd) al conjunto maestro.
-    // Así select() podrá avisar cuando haya nuevas conexiones pendientes (accept()).
-    FD_SET(listenfd, &allset);
-    
-    int maxfd = listenfd;
+// Bucle de eventos de un worker: sólo atiende sus propias conexiones y su inbox.
+static void *worker_run(void *arg) {
+    Worker *w = arg;
+    /*
+        epoll reemplaza a select():
+        - epoll_create1()  crea la instancia; el kernel guarda el conjunto de fds vigilados,
+                           así que no hay que reconstruir un fd_set en cada vuelta.
+        - epoll_ctl()      agrega/quita fds (EPOLL_CTL_ADD / EPOLL_CTL_DEL).
+        - epoll_wait()     devuelve SÓLO los fds listos, así el costo de cada despertar es
+                           O(fds listos) y no O(maxfd). Tampoco hay límite de FD_SETSIZE=1024.
+    */
+    self = w;
+    registry_init();
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1"); exit(1);
+    }
+    int listenfd = w->listenfd;
 
-    // select() necesita saber el mayor fd que estás vigilando (se pasa como maxfd+1).
-    // Arranca siendo listenfd; cada vez que aceptes un nuevo cliente, si su fd es mayor, actualiza maxfd.
+    // Agrega el socket de escucha para que epoll avise cuando haya conexiones pendientes (accept()).
+    struct epoll_event lev = {0};
+    lev.events = EPOLLIN | EPOLLET;
+    lev.data.fd = listenfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &lev) < 0) {
+        perror("epoll_ctl"); exit(1);
+    }
 
-    printf("Broker TCP escuchando en puerto %d...\n", PORT);
+    // eventfd del inbox: otros workers lo usan para avisar que hay publicaciones para este shard.
+    struct epoll_event eev = {0};
+    eev.events = EPOLLIN;
+    eev.data.fd = w->inbox.evfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->inbox.evfd, &eev) < 0) {
+        perror("epoll_ctl"); exit(1);
+    }
 
-    char buf[BUF_SIZE];
+    // Buffer de lectura compartido por los clientes del worker (ver read_client()).
+    char *scratch = malloc(IN_SCRATCH);
+    if (!scratch) { perror("malloc"); exit(1); }
+    struct epoll_event events[MAX_EVENTS];
 
     for (;;) {
-        rset = allset;
-
-
-        /*
-        Firma general de select():
-
-        int select(
-            int nfds,           // 1 + valor del descriptor MÁS ALTO que vigilas
-            fd_set *readfds,    // conjunto a vigilar por "listo para leer"   (puede ser NULL)
-            fd_set *writefds,   // conjunto a vigilar por "listo para escribir" (puede ser NULL)
-            fd_set *exceptfds,  // conjunto a vigilar por condiciones excepcionales (puede ser NULL)
-            struct timeval *timeout // cuánto esperar: NULL = infinito; {0,0} = no bloquear; o un tiempo
-        );
-
-        Retorna: 
-        >0  número de descriptores "listos" en los conjuntos (se MODIFICAN in-place),
-        0  si expiró el timeout sin eventos,
-        -1  en error (errno establece la causa, p.ej. EINTR si se interrumpió por señal).
-        */
-        int nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
+        // -1 = esperar indefinidamente. Retorna cuántos eventos llenó en events[].
+        int nready = epoll_wait(epfd, events, MAX_EVENTS, -1);
         if (nready < 0) { 
-            perror("select"); 
+            if (errno != EINTR) perror("epoll_wait"); 
             continue; 
         }
 
-        
-        if (FD_ISSET(listenfd, &rset)) {
-            //Hay conexiones pendientes en el socket de escucha.
-
-            // Estructuras para guardar la info del cliente que se conecta.
-            struct sockaddr_in cli;  //IPv4 del cliente
-            socklen_t clilen = sizeof(cli);
-            // Aceptar la conexión pendiente.
-            int connfd = accept(listenfd, (struct sockaddr*)&cli, &clilen);
-            if (connfd >= 0) {
-                // Añadir a los clientes
-                int placed = 0;
-                for (int i = 0; i < MAX_CLIENTS; ++i) {
-                    if (clients[i].fd < 0) {
-                        clients[i].fd = connfd;
-                        clients[i].role = ROLE_UNKNOWN;
-                        clients[i].topic[0] = '\0';
-                        FD_SET(connfd, &allset);
-                        if (connfd > maxfd) maxfd = connfd;
-                        placed = 1;
-                        break;
-                    }
-                }
-                if (!placed) {
-                    const char *full = "ERR Server full\n";
-                    send(connfd, full, strlen(full), 0);
-                    close(connfd);
-                }
+        for (int i = 0; i < nready; ++i) {
+            int fd = events[i].data.fd;
+
+            if (fd == listenfd) {
+                //Hay conexiones pendientes en el socket de escucha.
+                accept_all(listenfd);
+                continue;
             }
-            if (--nready <= 0) continue;
-        }
-
-
-        for (int i = 0; i <= maxfd; ++i) {
-
-            //listenfd ya fue atendido arriba en acept().
-            if (i == listenfd) continue;
-            
-            //Encontrar idx del cliente con fd=i
-            int idx = -1;
-            for (int k = 0; k < MAX_CLIENTS; ++k) if (clients[k].fd == i) { idx = k; break; }
-            //Ya fue gestionado el cliente.
-            if (idx < 0) continue;
-
-            if (FD_ISSET(i, &rset)) {
-                // esta listo para lectura, se lee con recv()
-                ssize_t n = recv(i, buf, sizeof(buf)-1, 0);
-                if (n <= 0) {
-                    //Error, toca sacarlo del conjunto y eliminar el cliente.
-                    FD_CLR(i, &allset);
-                    remove_client(idx, &allset, &maxfd);
-                } else {
-                    buf[n] = '\0';
-                    // procesar por líneas (pueden venir varias)
-                    char *saveptr = NULL;
-                    //strtok_r= split
-                    char *line = strtok_r(buf, "\n", &saveptr);
-                    while (line) {
-                        handle_line(idx, line);
-                        line = strtok_r(NULL, "\n", &saveptr);
-                    }
-                }
+            if (fd == w->inbox.evfd) {
+                drain_inbox();
+                continue;
+            }
+            //Ya fue gestionado el cliente (p. ej. se cerró antes en esta misma vuelta).
+            if (clients[fd].fd < 0 || clients[fd].dead) continue;
+
+            if (events[i].events & EPOLLOUT) {
+                flush_client(fd);
+                if (clients[fd].replay) replay_pump(fd);
             }
+
+            // Aunque venga EPOLLHUP/EPOLLRDHUP se lee primero: puede quedar data pendiente
+            // y recv() devolverá 0 al final, lo que elimina al cliente.
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                read_client(fd, scratch, IN_SCRATCH);
+        }
+        reap_clients();
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+
+    // Con MSG_NOSIGNAL/writev a un socket cerrado no queremos morir por SIGPIPE.
+    signal(SIGPIPE, SIG_IGN);
+
+    // init de clients
+    init_clients();
+
+    // El hilo del log arranca antes que los workers: ninguna publicación se pierde.
+    if (log_dir) log_init();
+
+    // Todos los workers (socket, eventfd e inbox) se preparan antes de arrancar los hilos,
+    // así ninguno publica hacia un inbox que todavía no existe.
+    workers = calloc((size_t)nworkers, sizeof(Worker));
+    if (!workers) { perror("calloc"); exit(1); }
+    for (int i = 0; i < nworkers; ++i) {
+        workers[i].id = i;
+        workers[i].listenfd = open_listener();
+        if (workers[i].listenfd < 0) exit(1);
+        if (inbox_init(&workers[i].inbox) < 0) { perror("eventfd"); exit(1); }
+    }
+
+    printf("Broker TCP escuchando en puerto %d (hasta %d descriptores, %d worker(s))...\n",
+           PORT, max_clients, nworkers);
+
+    // El worker 0 corre en el hilo principal. Si hay varios, cada hilo se fija a un núcleo.
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < nworkers; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            perror("pthread_create"); exit(1);
+        }
+        if (ncpu > 1) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % ncpu, &set);
+            pthread_setaffinity_np(workers[i].thread, sizeof(set), &set);
         }
     }
+    worker_run(&workers[0]);
     return 0;
 }
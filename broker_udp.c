@@ -1,50 +1,362 @@
+#define _GNU_SOURCE   // recvmmsg / sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
-#define MAX_CLIENTS 15
 #define BUFFER_SIZE 1024
 #define PORT 5926
+#define BATCH 64          // datagramas por recvmmsg()
+#define MAX_OUT 1024      // envíos acumulados antes de un sendmmsg()
+#define TOPIC_LEN 50
+#define BUCKETS_INIT 256  // buckets iniciales de las tablas hash (potencia de 2)
+#define IDLE_TIMEOUT_S 120 // suscriptor sin actividad en tanto tiempo se expira (0 = nunca)
+#define SWEEP_INTERVAL_S 1 // cada cuánto se revisan los expirados como mínimo
 
+typedef struct Topic Topic;
+typedef struct Peer Peer;
+
+// Suscripción de un peer a un tema. pos es la posición del peer en topic->subs.
+typedef struct {
+    Topic *topic;
+    int pos;
+} Sub;
+
+// Entrada en la lista de suscriptores de un tema. slot es la posición de esta
+// suscripción dentro de peer->subs, para poder borrar en O(1) desde ambos lados.
 typedef struct {
+    Peer *peer;
+    int slot;
+} SubEntry;
+
+// Un suscriptor, identificado por su dirección (IP, puerto). Puede estar en varios temas.
+struct Peer {
     struct sockaddr_in addr;
     socklen_t addr_len;
-    char topic[50];
-} Subscriber;
+    uint32_t hash;
+    time_t last_seen;
+    Sub *subs;
+    int nsubs, cap;
+    Peer *next;                  // siguiente en el mismo bucket
+    Peer *lru_prev, *lru_next;   // lista ordenada por última actividad (el más viejo primero)
+};
 
-Subscriber subscribers[MAX_CLIENTS];
-int subscriber_count = 0;
+// Tema: nombre y lista compacta de suscriptores. Publicar cuesta O(suscriptores del tema).
+struct Topic {
+    char name[TOPIC_LEN];
+    uint32_t hash;
+    SubEntry *subs;
+    int nsubs, cap;
+    Topic *next;
+};
 
-void add_subscriber(struct sockaddr_in addr, socklen_t addr_len, char *topic) {
-    if (subscriber_count < MAX_CLIENTS) {
-        subscribers[subscriber_count].addr = addr;
-        subscribers[subscriber_count].addr_len = addr_len;
-        strcpy(subscribers[subscriber_count].topic, topic);
-        subscriber_count++;
-        printf("Nuevo suscriptor agregado al tema: %s\n", topic);
-    } else {
-        printf("Máximo número de suscriptores alcanzado.\n");
-    }
-}
-
-void distribute_message(int sockfd, char *topic, char *message) {
-    for (int i = 0; i < subscriber_count; i++) {
-        if (strcmp(subscribers[i].topic, topic) == 0) {
-            sendto(sockfd, message, strlen(message), 0,
-                   (struct sockaddr *)&subscribers[i].addr,
-                   subscribers[i].addr_len);
+Peer **peer_table;
+size_t peer_buckets, peer_count;
+Topic **topic_table;
+size_t topic_buckets, topic_count;
+Peer *lru_head, *lru_tail;
+int idle_timeout = IDLE_TIMEOUT_S;
+
+// Envíos pendientes de la tanda actual. Cada entrada apunta al mensaje dentro del buffer
+// de recepción (que sigue vivo hasta que termina la tanda), así que no se copia el mensaje.
+// La dirección sí se copia: un UNSUBSCRIBE en la misma tanda puede liberar al peer.
+static struct mmsghdr     out_msgs[MAX_OUT];
+static struct iovec       out_iov[MAX_OUT];
+static struct sockaddr_in out_addr[MAX_OUT];
+static int                out_count = 0;
+
+// Manda todos los envíos acumulados con sendmmsg() (una llamada al sistema por tanda).
+void flush_out(int sockfd) {
+    int done = 0;
+    while (done < out_count) {
+        int r = sendmmsg(sockfd, out_msgs + done, (unsigned)(out_count - done), 0);
+        if (r <= 0) {
+            // El datagrama que falla se descarta (UDP no garantiza entrega) y se sigue.
+            done++;
+            continue;
+        }
+        done += r;
+    }
+    out_count = 0;
+}
+
+uint32_t djb2_hash(const char *s) {
+    uint32_t h = 5381u;
+    while (*s) h = ((h << 5) + h) + (uint32_t)(unsigned char)*s++;
+    return h;
+}
+
+uint32_t addr_hash(const struct sockaddr_in *a) {
+    uint32_t h = (uint32_t)a->sin_addr.s_addr * 2654435761u;
+    return h ^ ((uint32_t)a->sin_port * 40503u);
+}
+
+void *table_alloc(size_t nb) {
+    void *t = calloc(nb, sizeof(void*));
+    if (!t) { perror("calloc"); exit(EXIT_FAILURE); }
+    return t;
+}
+
+// Duplica la cantidad de buckets y redistribuye las cadenas.
+void peer_table_grow(void) {
+    size_t nb = peer_buckets * 2;
+    Peer **nt = calloc(nb, sizeof(Peer*));
+    if (!nt) return; // seguimos con la tabla actual, sólo más cargada
+    for (size_t i = 0; i < peer_buckets; i++) {
+        Peer *p = peer_table[i];
+        while (p) {
+            Peer *next = p->next;
+            p->next = nt[p->hash & (nb - 1)];
+            nt[p->hash & (nb - 1)] = p;
+            p = next;
         }
     }
+    free(peer_table);
+    peer_table = nt;
+    peer_buckets = nb;
 }
 
-int main() {
+void topic_table_grow(void) {
+    size_t nb = topic_buckets * 2;
+    Topic **nt = calloc(nb, sizeof(Topic*));
+    if (!nt) return;
+    for (size_t i = 0; i < topic_buckets; i++) {
+        Topic *t = topic_table[i];
+        while (t) {
+            Topic *next = t->next;
+            t->next = nt[t->hash & (nb - 1)];
+            nt[t->hash & (nb - 1)] = t;
+            t = next;
+        }
+    }
+    free(topic_table);
+    topic_table = nt;
+    topic_buckets = nb;
+}
+
+// Busca un tema; si create != 0 y no existe, lo crea.
+Topic *topic_lookup(const char *name, int create) {
+    uint32_t h = djb2_hash(name);
+    for (Topic *t = topic_table[h & (topic_buckets - 1)]; t; t = t->next)
+        if (t->hash == h && strcmp(t->name, name) == 0) return t;
+    if (!create) return NULL;
+
+    Topic *t = calloc(1, sizeof(Topic));
+    if (!t) return NULL;
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    t->hash = h;
+    t->next = topic_table[h & (topic_buckets - 1)];
+    topic_table[h & (topic_buckets - 1)] = t;
+    if (++topic_count > topic_buckets) topic_table_grow();
+    return t;
+}
+
+// Saca el tema de la tabla y lo libera (cuando se queda sin suscriptores).
+void topic_free(Topic *t) {
+    Topic **pp = &topic_table[t->hash & (topic_buckets - 1)];
+    while (*pp && *pp != t) pp = &(*pp)->next;
+    if (*pp) *pp = t->next;
+    topic_count--;
+    free(t->subs);
+    free(t);
+}
+
+void lru_unlink(Peer *p) {
+    if (p->lru_prev) p->lru_prev->lru_next = p->lru_next; else lru_head = p->lru_next;
+    if (p->lru_next) p->lru_next->lru_prev = p->lru_prev; else lru_tail = p->lru_prev;
+    p->lru_prev = p->lru_next = NULL;
+}
+
+void lru_append(Peer *p) {
+    p->lru_prev = lru_tail;
+    p->lru_next = NULL;
+    if (lru_tail) lru_tail->lru_next = p; else lru_head = p;
+    lru_tail = p;
+}
+
+// Marca actividad del peer: pasa al final de la lista de expiración.
+void peer_touch(Peer *p, time_t now) {
+    p->last_seen = now;
+    if (p != lru_tail) {
+        lru_unlink(p);
+        lru_append(p);
+    }
+}
+
+// Busca el peer de esa dirección; si create != 0 y no existe, lo crea.
+Peer *peer_lookup(const struct sockaddr_in *addr, socklen_t addr_len, int create) {
+    uint32_t h = addr_hash(addr);
+    for (Peer *p = peer_table[h & (peer_buckets - 1)]; p; p = p->next)
+        if (p->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            p->addr.sin_port == addr->sin_port) return p;
+    if (!create) return NULL;
+
+    Peer *p = calloc(1, sizeof(Peer));
+    if (!p) return NULL;
+    p->addr = *addr;
+    p->addr_len = addr_len;
+    p->hash = h;
+    p->last_seen = time(NULL);
+    p->next = peer_table[h & (peer_buckets - 1)];
+    peer_table[h & (peer_buckets - 1)] = p;
+    lru_append(p);
+    if (++peer_count > peer_buckets) peer_table_grow();
+    return p;
+}
+
+// Posición de la suscripción del peer a ese tema; -1 si no existe.
+int peer_find_sub(const Peer *p, const Topic *t) {
+    for (int i = 0; i < p->nsubs; i++)
+        if (p->subs[i].topic == t) return i;
+    return -1;
+}
+
+// Quita la suscripción 'slot' del peer. En ambos arreglos el último ocupa el hueco
+// (swap-remove) y se corrige la referencia cruzada del elemento movido.
+void peer_remove_sub(Peer *p, int slot) {
+    Sub s = p->subs[slot];
+    Topic *t = s.topic;
+
+    SubEntry last = t->subs[--t->nsubs];
+    if (s.pos != t->nsubs) {
+        t->subs[s.pos] = last;
+        last.peer->subs[last.slot].pos = s.pos;
+    }
+
+    Sub moved = p->subs[--p->nsubs];
+    if (slot != p->nsubs) {
+        p->subs[slot] = moved;
+        moved.topic->subs[moved.pos].slot = slot;
+    }
+
+    if (t->nsubs == 0) topic_free(t);
+}
+
+// Saca al peer de todos sus temas y de las tablas.
+void peer_free(Peer *p) {
+    while (p->nsubs > 0) peer_remove_sub(p, p->nsubs - 1);
+    Peer **pp = &peer_table[p->hash & (peer_buckets - 1)];
+    while (*pp && *pp != p) pp = &(*pp)->next;
+    if (*pp) *pp = p->next;
+    peer_count--;
+    lru_unlink(p);
+    free(p->subs);
+    free(p);
+}
+
+// Registra (addr, tema). Si ya estaba suscrito sólo se refresca su actividad.
+void add_subscriber(struct sockaddr_in addr, socklen_t addr_len, char *topic) {
+    Peer *p = peer_lookup(&addr, addr_len, 1);
+    Topic *t = topic_lookup(topic, 1);
+    if (!p || !t) {
+        printf("Sin memoria para nuevo suscriptor.\n");
+        if (t && t->nsubs == 0) topic_free(t);
+        if (p && p->nsubs == 0) peer_free(p);
+        return;
+    }
+    peer_touch(p, time(NULL));
+    if (peer_find_sub(p, t) >= 0) return;   // SUBSCRIBE repetido (keepalive)
+
+    if (p->nsubs == p->cap) {
+        int ncap = p->cap ? p->cap * 2 : 2;
+        Sub *ns = realloc(p->subs, (size_t)ncap * sizeof(Sub));
+        if (!ns) goto fail;
+        p->subs = ns;
+        p->cap = ncap;
+    }
+    if (t->nsubs == t->cap) {
+        int ncap = t->cap ? t->cap * 2 : 4;
+        SubEntry *nv = realloc(t->subs, (size_t)ncap * sizeof(SubEntry));
+        if (!nv) goto fail;
+        t->subs = nv;
+        t->cap = ncap;
+    }
+    p->subs[p->nsubs].topic = t;
+    p->subs[p->nsubs].pos = t->nsubs;
+    t->subs[t->nsubs].peer = p;
+    t->subs[t->nsubs].slot = p->nsubs;
+    t->nsubs++;
+    p->nsubs++;
+    printf("Nuevo suscriptor agregado al tema: %s\n", topic);
+    return;
+
+fail:
+    printf("Sin memoria para nuevo suscriptor.\n");
+    if (t->nsubs == 0) topic_free(t);
+    if (p->nsubs == 0) peer_free(p);
+}
+
+// UNSUBSCRIBE <tema> quita ese tema; UNSUBSCRIBE sin tema quita al peer por completo.
+void remove_subscriber(const struct sockaddr_in *addr, const char *topic) {
+    Peer *p = peer_lookup(addr, sizeof(*addr), 0);
+    if (!p) return;
+    if (topic) {
+        Topic *t = topic_lookup(topic, 0);
+        int slot = t ? peer_find_sub(p, t) : -1;
+        if (slot < 0) return;
+        peer_remove_sub(p, slot);
+        printf("Suscriptor retirado del tema: %s\n", topic);
+        if (p->nsubs > 0) return;
+    }
+    peer_free(p);
+}
+
+// Expira a los peers sin actividad. La lista está ordenada por last_seen,
+// así que sólo se recorren los que efectivamente vencieron.
+void expire_idle(time_t now) {
+    if (idle_timeout <= 0) return;
+    while (lru_head && now - lru_head->last_seen >= idle_timeout) {
+        printf("Suscriptor expirado por inactividad (%d temas)\n", lru_head->nsubs);
+        peer_free(lru_head);
+    }
+}
+
+// En vez de un sendto() por suscriptor, agrega cada destino del tema al vector de la tanda.
+void distribute_message(int sockfd, char *topic, char *message, size_t len) {
+    Topic *t = topic_lookup(topic, 0);
+    if (!t) return;
+    for (int i = 0; i < t->nsubs; i++) {
+        Peer *p = t->subs[i].peer;
+        if (out_count == MAX_OUT) flush_out(sockfd);
+        out_addr[out_count] = p->addr;
+        out_iov[out_count].iov_base = message;
+        out_iov[out_count].iov_len = len;
+        memset(&out_msgs[out_count].msg_hdr, 0, sizeof(struct msghdr));
+        out_msgs[out_count].msg_hdr.msg_name = &out_addr[out_count];
+        out_msgs[out_count].msg_hdr.msg_namelen = p->addr_len;
+        out_msgs[out_count].msg_hdr.msg_iov = &out_iov[out_count];
+        out_msgs[out_count].msg_hdr.msg_iovlen = 1;
+        out_count++;
+    }
+}
+
+int main(int argc, char *argv[]) {
     int sockfd;
-    struct sockaddr_in server_addr, client_addr;
-    char buffer[BUFFER_SIZE];
-    socklen_t addr_len = sizeof(client_addr);
+    struct sockaddr_in server_addr;
+
+    // --idle=SEG: segundos sin actividad antes de expirar a un suscriptor (0 = nunca)
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--idle=", 7) == 0) idle_timeout = atoi(argv[i] + 7);
+        else {
+            fprintf(stderr, "Uso: %s [--idle=SEG]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    peer_table = table_alloc(BUCKETS_INIT);
+    peer_buckets = BUCKETS_INIT;
+    topic_table = table_alloc(BUCKETS_INIT);
+    topic_buckets = BUCKETS_INIT;
+
+    // Buffers de una tanda de recvmmsg(): un datagrama por entrada.
+    static char buffers[BATCH][BUFFER_SIZE];
+    static struct sockaddr_in client_addrs[BATCH];
+    static struct iovec iov[BATCH];
+    static struct mmsghdr msgs[BATCH];
 
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
@@ -61,23 +373,65 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
+    // Timeout de lectura para despertar y expirar suscriptores aunque no llegue tráfico.
+    struct timeval tv = { SWEEP_INTERVAL_S, 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
     printf("Broker UDP escuchando en puerto %d...\n", PORT);
 
     while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        recvfrom(sockfd, buffer, BUFFER_SIZE, 0,
-                 (struct sockaddr *)&client_addr, &addr_len);
-
-        if (strncmp(buffer, "SUBSCRIBE", 9) == 0) {
-            char topic[50];
-            sscanf(buffer, "SUBSCRIBE %s", topic);
-            add_subscriber(client_addr, addr_len, topic);
-        } else if (strncmp(buffer, "PUBLISH", 7) == 0) {
-            char topic[50], message[512];
-            sscanf(buffer, "PUBLISH %s %[^\n]", topic, message);
-            printf("Mensaje recibido para %s: %s\n", topic, message);
-            distribute_message(sockfd, topic, message);
+        for (int i = 0; i < BATCH; i++) {
+            iov[i].iov_base = buffers[i];
+            iov[i].iov_len = BUFFER_SIZE - 1;   // espacio para el '\0'
+            memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            msgs[i].msg_hdr.msg_name = &client_addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(client_addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
         }
+
+        // Bloquea hasta el primer datagrama y luego se lleva todos los que ya estén en cola
+        // (hasta BATCH) en la misma llamada.
+        int n = recvmmsg(sockfd, msgs, BATCH, MSG_WAITFORONE, NULL);
+        time_t now = time(NULL);
+        if (n < 0) n = 0;   // timeout: sólo toca expirar
+
+        for (int i = 0; i < n; i++) {
+            char *buffer = buffers[i];
+            buffer[msgs[i].msg_len] = '\0';
+            socklen_t addr_len = msgs[i].msg_hdr.msg_namelen;
+
+            // Cualquier datagrama de un suscriptor conocido cuenta como actividad.
+            Peer *p = peer_lookup(&client_addrs[i], addr_len, 0);
+            if (p) peer_touch(p, now);
+
+            if (strncmp(buffer, "SUBSCRIBE", 9) == 0) {
+                char topic[TOPIC_LEN];
+                if (sscanf(buffer, "SUBSCRIBE %49s", topic) == 1)
+                    add_subscriber(client_addrs[i], addr_len, topic);
+            } else if (strncmp(buffer, "UNSUBSCRIBE", 11) == 0) {
+                char topic[TOPIC_LEN];
+                if (sscanf(buffer, "UNSUBSCRIBE %49s", topic) == 1)
+                    remove_subscriber(&client_addrs[i], topic);
+                else
+                    remove_subscriber(&client_addrs[i], NULL);
+            } else if (strncmp(buffer, "PUBLISH", 7) == 0) {
+                // PUBLISH <tema> <mensaje>: el mensaje se reenvía desde el mismo buffer.
+                char topic[TOPIC_LEN];
+                int off = 0;
+                if (sscanf(buffer, "PUBLISH %49s %n", topic, &off) != 1 || off == 0) continue;
+                char *message = buffer + off;
+                size_t len = strcspn(message, "\n");
+                message[len] = '\0';
+                printf("Mensaje recibido para %s: %s\n", topic, message);
+                distribute_message(sockfd, topic, message, len);
+            }
+        }
+
+        // Todo el fan-out de la tanda sale en un solo sendmmsg().
+        flush_out(sockfd);
+
+        expire_idle(now);
     }
 
     close(sockfd);
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -10,7 +11,60 @@
 #define PORT 5927
 #define BUF_SIZE 2048
 
-int main(void) {
+// Modo binario (opcional, ./publisher_tcp --bin): mismo encabezado que broker_tcp.c.
+#define BIN_PUB 3
+#define BIN_F_RETAIN 0x01   // flags de BIN_PUB: el broker lo guarda como valor retenido
+
+#pragma pack(push, 1)
+typedef struct {
+    uint8_t  op;
+    uint8_t  flags;
+    uint16_t topic_len;   // bytes del tema que siguen al encabezado
+    uint32_t payload_len; // bytes del mensaje que siguen al tema
+} BinHeader;
+#pragma pack(pop)
+
+// Pide el modo binario con la línea "HELLO BIN" y espera "OK BIN".
+// Se lee byte a byte para no consumir nada que venga después de la respuesta.
+static int negotiate_binary(int sock) {
+    const char *hello = "HELLO BIN\n";
+    if (send(sock, hello, strlen(hello), 0) < 0) return -1;
+    char line[64];
+    size_t n = 0;
+    while (n < sizeof(line) - 1) {
+        if (recv(sock, line + n, 1, 0) != 1) return -1;
+        if (line[n] == '\n') break;
+        ++n;
+    }
+    line[n] = '\0';
+    return strncmp(line, "OK BIN", 6) == 0 ? 0 : -1;
+}
+
+// Arma el frame [BinHeader][tema][mensaje] en out y devuelve su tamaño.
+static size_t build_frame(char *out, size_t cap, const char *topic, const char *msg,
+                          uint8_t flags) {
+    size_t tlen = strlen(topic), plen = strlen(msg);
+    if (sizeof(BinHeader) + tlen + plen > cap) plen = cap - sizeof(BinHeader) - tlen;
+    BinHeader h;
+    h.op = BIN_PUB;
+    h.flags = flags;
+    h.topic_len = htons((uint16_t)tlen);
+    h.payload_len = htonl((uint32_t)plen);
+    memcpy(out, &h, sizeof(h));
+    memcpy(out + sizeof(h), topic, tlen);
+    memcpy(out + sizeof(h) + tlen, msg, plen);
+    return sizeof(h) + tlen + plen;
+}
+
+int main(int argc, char **argv) {
+
+    // --bin: usar frames binarios en lugar de líneas de texto.
+    // --retain: cada mensaje queda como valor retenido del tema (vacío = borrarlo).
+    int binary = 0, retain = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--bin") == 0) binary = 1;
+        else if (strcmp(argv[i], "--retain") == 0) retain = 1;
+    }
 
     //-----------------CREAR EL SOCKET TCP-----------------
 
@@ -61,6 +115,11 @@ int main(void) {
         exit(1); 
     }
 
+    if (binary && negotiate_binary(sock) < 0) {
+        fprintf(stderr, "El broker no aceptó el modo binario\n");
+        exit(1);
+    }
+
     //-----------------PUBLICAR MENSAJES A UN TEMA-----------------
 
     // Variables locales: topic para el texto del tema a publicar
@@ -90,12 +149,19 @@ int main(void) {
         // snprintf escribe en dst como lo haría printf, pero a lo sumo dst_size-1 caracteres,
         // y si dst_size > 0 siempre termina en '\0'.
         // No desborda el búfer
-        snprintf(out, sizeof(out), "PUBLISH %s %s\n", topic, line);
+        // En modo binario el mensaje va como bytes opacos después del encabezado.
+        size_t len;
+        if (binary) {
+            len = build_frame(out, sizeof(out), topic, line, retain ? BIN_F_RETAIN : 0);
+        } else {
+            snprintf(out, sizeof(out), "%s %s %s\n", retain ? "RETAIN" : "PUBLISH", topic, line);
+            len = strlen(out);
+        }
 
         //send envía datos a través del socket creado con descriptor sock.
         // Con TCP, send solo pone datos en el buffer del kernel; no garantiza que el peer ya los recibió.
         // La garantía y los reintentos por pérdida de ACKs los hace TCP en el kernel.
-        if (send(sock, out, strlen(out), 0) < 0) { 
+        if (send(sock, out, len, 0) < 0) { 
             perror("send"); 
             break; 
             }
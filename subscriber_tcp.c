@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -11,9 +12,101 @@
 #define PORT 5927
 #define BUF_SIZE 2048
 
+// Modo binario (opcional, ./subscriber_tcp --bin): mismo encabezado que broker_tcp.c.
+// Con --from=earliest|<offset>|@<ms> (broker con --log-dir) primero llega lo guardado.
+#define BIN_SUB 1
+#define BIN_MSG 4
+#define BIN_OK  5
+#define BIN_ERR 6
+
+#pragma pack(push, 1)
+typedef struct {
+    uint8_t  op;
+    uint8_t  flags;
+    uint16_t topic_len;   // bytes del tema que siguen al encabezado
+    uint32_t payload_len; // bytes del mensaje que siguen al tema
+} BinHeader;
+#pragma pack(pop)
+
+// Lee exactamente len bytes (recv puede devolver menos de lo pedido).
+static int recv_all(int sock, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = recv(sock, buf + got, len - got, 0);
+        if (n <= 0) return -1;
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+// Pide el modo binario con la línea "HELLO BIN" y espera "OK BIN".
+static int negotiate_binary(int sock) {
+    const char *hello = "HELLO BIN\n";
+    if (send(sock, hello, strlen(hello), 0) < 0) return -1;
+    char line[64];
+    size_t n = 0;
+    while (n < sizeof(line) - 1) {
+        if (recv(sock, line + n, 1, 0) != 1) return -1;
+        if (line[n] == '\n') break;
+        ++n;
+    }
+    line[n] = '\0';
+    return strncmp(line, "OK BIN", 6) == 0 ? 0 : -1;
+}
+
+// El payload del frame es la posición de inicio (vacío = sólo lo nuevo).
+static int send_sub_frame(int sock, const char *topic, const char *from) {
+    char out[sizeof(BinHeader) + 256 + 32];
+    size_t tlen = strlen(topic), flen = from ? strlen(from) : 0;
+    if (tlen > 255 || flen > 31) return -1;
+    BinHeader h;
+    h.op = BIN_SUB;
+    h.flags = 0;
+    h.topic_len = htons((uint16_t)tlen);
+    h.payload_len = htonl((uint32_t)flen);
+    memcpy(out, &h, sizeof(h));
+    memcpy(out + sizeof(h), topic, tlen);
+    memcpy(out + sizeof(h) + tlen, from, flen);
+    return send(sock, out, sizeof(h) + tlen + flen, 0) < 0 ? -1 : 0;
+}
+
+// Recibe frames del broker y los muestra como "[tema] mensaje".
+static void receive_frames(int sock) {
+    char topic[256];
+    char *payload = NULL;
+    size_t cap = 0;
+    for (;;) {
+        BinHeader h;
+        if (recv_all(sock, (char*)&h, sizeof(h)) < 0) break;
+        size_t tlen = ntohs(h.topic_len), plen = ntohl(h.payload_len);
+        if (tlen >= sizeof(topic)) break;
+        if (plen + 1 > cap) {
+            char *np = realloc(payload, plen + 1);
+            if (!np) break;
+            payload = np;
+            cap = plen + 1;
+        }
+        if (recv_all(sock, topic, tlen) < 0 || recv_all(sock, payload, plen) < 0) break;
+        topic[tlen] = '\0';
+        if (h.op == BIN_MSG)      printf("[%s] %.*s\n", topic, (int)plen, payload);
+        else if (h.op == BIN_OK)  printf("%.*s\n", (int)plen, payload);
+        else if (h.op == BIN_ERR) printf("%.*s\n", (int)plen, payload);
+        fflush(stdout);
+    }
+    puts("Conexión cerrada.");
+    free(payload);
+}
 
+int main(int argc, char **argv) {
 
-int main(void) {
+    // --bin: usar frames binarios en lugar de líneas de texto.
+    // --from=...: posición desde la que empezar cada suscripción (ver SUBSCRIBE ... FROM).
+    int binary = 0;
+    const char *from = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--bin") == 0) binary = 1;
+        else if (strncmp(argv[i], "--from=", 7) == 0) from = argv[i] + 7;
+    }
 
 
 //-----------------CREAR EL SOCKET TCP-----------------
@@ -65,14 +158,21 @@ int main(void) {
          exit(1); 
         }
 
+    if (binary && negotiate_binary(sock) < 0) {
+        fprintf(stderr, "El broker no aceptó el modo binario\n");
+        exit(1);
+    }
+
 //-----------------SUSCRIBIRSE A UN TEMA Y RECIBIR MENSAJES-----------------
 
 
     // Variables locales: topic para el texto que escribe el usuario, 
     // y out para construir el mensaje a enviar.
-    char topic[128], out[256];
+    char topic[1024], out[256];
 
-    printf("Tema a suscribirse (ej: EquipoAvsB): ");
+    // Se pueden dar varios temas o patrones separados por espacio o coma.
+    // Patrones: '*' = un nivel (liga/*/goles), '#' = el resto de niveles (liga/#).
+    printf("Tema(s) a suscribirse (ej: EquipoAvsB o liga/*/goles,liga/#): ");
 
     // fgets es una función de la biblioteca estándar de C que se utiliza para leer una cadena de caracteres de un flujo (stdin)
     // char *fgets (char *string, int n, FILE *stream); en <stdio.h>
@@ -81,24 +181,36 @@ int main(void) {
     // índice del primer '\n' para reemplazarlo por '\0' (o deja el '\0' final tal cual si no había \n).
     topic[strcspn(topic, "\n")] = 0;
 
-    // Escribe en dst como lo haría printf, pero a lo sumo dst_size-1 caracteres, y
-    // si dst_size > 0 siempre termina en '\0'.
-    // No desborda el búfer
-    snprintf(out, sizeof(out), "SUBSCRIBE %s\n", topic);
-
-    //send envía datos a través del socket creado con descriptor sock.
-    // Con TCP, send solo pone datos en el buffer del kernel; no garantiza que el peer ya los recibió.
-    // La garantia y los reintentos por pérdida de ACKs los hace TCP en el kernel.
-
-    if (send(sock, out, strlen(out), 0) < 0) { 
-        perror("send"); 
-        return 1; 
+    // Un SUBSCRIBE por tema, todos por la misma conexión.
+    char *saveptr = NULL;
+    for (char *t = strtok_r(topic, " ,", &saveptr); t; t = strtok_r(NULL, " ,", &saveptr)) {
+        // Escribe en dst como lo haría printf, pero a lo sumo dst_size-1 caracteres, y
+        // si dst_size > 0 siempre termina en '\0'.
+        // No desborda el búfer
+        if (from) snprintf(out, sizeof(out), "SUBSCRIBE %s FROM %s\n", t, from);
+        else      snprintf(out, sizeof(out), "SUBSCRIBE %s\n", t);
+
+        //send envía datos a través del socket creado con descriptor sock.
+        // Con TCP, send solo pone datos en el buffer del kernel; no garantiza que el peer ya los recibió.
+        // La garantia y los reintentos por pérdida de ACKs los hace TCP en el kernel.
+
+        int rc = binary ? send_sub_frame(sock, t, from) : (int)send(sock, out, strlen(out), 0);
+        if (rc < 0) { 
+            perror("send"); 
+            return 1; 
+        }
+        printf("Suscrito a %s.\n", t);
     }
-
-    printf("Suscrito a %s. Esperando mensajes...\n", topic);
+    printf("Esperando mensajes...\n");
 
 //-----------------Recibir mensajes y mostrarlos por pantalla
 
+    if (binary) {
+        receive_frames(sock);
+        close(sock);
+        return 0;
+    }
+
     //Buffer de recepción
     char buf[BUF_SIZE];
 
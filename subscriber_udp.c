@@ -2,11 +2,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
 #define BUFFER_SIZE 1024
 #define PORT 5926
+#define RESUBSCRIBE_S 30  // el broker expira suscriptores inactivos: se repite el SUBSCRIBE
 
 int main() {
     int sockfd;
@@ -39,12 +41,25 @@ int main() {
 
     printf("Suscrito al tema: %s\nEsperando mensajes...\n", topic);
 
+    // Timeout de lectura para poder renovar la suscripción aunque no lleguen mensajes.
+    struct timeval tv = { RESUBSCRIBE_S, 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    time_t last_sub = time(NULL);
+
     while (1) {
 
         //Esta línea limpia el contenido del buffer antes de recibir nuevos datos.
         memset(buffer, 0, BUFFER_SIZE);
-        recvfrom(sockfd, buffer, BUFFER_SIZE, 0, NULL, NULL);
-        printf("[Mensaje recibido] %s\n", buffer);
+        ssize_t n = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0, NULL, NULL);
+        if (n > 0) printf("[Mensaje recibido] %s\n", buffer);
+
+        // Keepalive: el SUBSCRIBE repetido no duplica la suscripción en el broker.
+        if (time(NULL) - last_sub >= RESUBSCRIBE_S) {
+            snprintf(buffer, BUFFER_SIZE, "SUBSCRIBE %s", topic);
+            sendto(sockfd, buffer, strlen(buffer), 0,
+                   (struct sockaddr *)&server_addr, sizeof(server_addr));
+            last_sub = time(NULL);
+        }
     }
 
     close(sockfd);